@@ -0,0 +1,775 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BUFFER_SIZE 1024
+#define READ_BUFFER (64 * 1024)
+#define MAX_CLIENTS 256
+#define MAX_SCENARIOS 32
+#define MAX_SERVER_ARGS 32
+#define DEFAULT_PORT 2199
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_SECONDS 5
+
+/**
+ * @brief 输出错误信息并退出程序
+ * @param msg 错误信息
+ */
+void error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/**
+ * @brief 测试场景的类型
+ */
+enum bench_kind
+{
+    BENCH_GET,  // 反复下载指定大小的文件
+    BENCH_PUT,  // 反复上传指定大小的文件
+    BENCH_DIR,  // 反复列出包含指定数量文件的目录
+    BENCH_STORM // 流水线发送指定数量的SIZE命令
+};
+
+/**
+ * @brief 一个测试场景, 例如"get:1m"
+ */
+struct scenario
+{
+    char name[64];        // 命令行上的写法
+    enum bench_kind kind; // 类型
+    long long param;      // 文件大小、目录中的文件数或流水线深度
+};
+
+/**
+ * @brief 到服务器的一个连接, 带有读缓冲区
+ */
+struct conn
+{
+    int fd;                 // 套接字描述符
+    char buf[READ_BUFFER];  // 读缓冲区
+    size_t start;           // 缓冲区中未处理数据的起始位置
+    size_t end;             // 缓冲区中数据的结束位置
+};
+
+/**
+ * @brief 一个模拟客户端线程的状态和结果
+ */
+struct bench_client
+{
+    const struct scenario *sc; // 正在运行的场景
+    int id;                    // 客户端编号
+    int port;                  // 服务器端口号
+    struct timespec deadline;  // 运行到此时刻为止
+    uint64_t *latency;         // 每次操作的延迟, 单位纳秒
+    size_t count;              // 已记录的延迟数
+    size_t capacity;           // latency数组的容量
+    long long ops;             // 完成的操作数, STORM按命令计数
+    long long bytes;           // 传输的数据字节数
+    int failed;                // 是否出错
+};
+
+/**
+ * @brief PUT使用的数据, 所有客户端共享
+ */
+static char *put_data;
+static long long put_size;
+
+/**
+ * @brief 把"4k"、"1m"、"2g"这样的大小转换为字节数
+ * @param text 大小的文本
+ * @return 字节数, 格式错误返回-1
+ */
+long long parse_size(const char *text)
+{
+    char *end;
+    long long n = strtoll(text, &end, 10);
+    if (end == text || n < 0)
+        return -1;
+    if (*end == 'k' || *end == 'K')
+        n <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        n <<= 20, end++;
+    else if (*end == 'g' || *end == 'G')
+        n <<= 30, end++;
+    return *end == '\0' ? n : -1;
+}
+
+/**
+ * @brief 解析"类型:参数"形式的场景
+ * @param text 场景文本
+ * @param sc 保存解析结果
+ * @return 成功返回0, 格式错误返回-1
+ */
+int parse_scenario(const char *text, struct scenario *sc)
+{
+    snprintf(sc->name, sizeof(sc->name), "%s", text);
+    const char *colon = strchr(text, ':');
+    size_t len = colon != NULL ? (size_t)(colon - text) : strlen(text);
+    sc->param = colon != NULL ? parse_size(colon + 1) : -1;
+
+    if (len == 3 && strncmp(text, "get", 3) == 0)
+        sc->kind = BENCH_GET;
+    else if (len == 3 && strncmp(text, "put", 3) == 0)
+        sc->kind = BENCH_PUT;
+    else if (len == 3 && strncmp(text, "dir", 3) == 0)
+        sc->kind = BENCH_DIR;
+    else if (len == 5 && strncmp(text, "storm", 5) == 0)
+    {
+        sc->kind = BENCH_STORM;
+        if (colon == NULL)
+            sc->param = 32;
+    }
+    else
+        return -1;
+    return sc->param > 0 ? 0 : -1;
+}
+
+/**
+ * @brief 读取当前时刻
+ * @return 单调时钟的当前时刻
+ */
+struct timespec now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts;
+}
+
+/**
+ * @brief 计算两个时刻之间的纳秒数
+ */
+uint64_t elapsed_ns(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) * 1000000000LL + (to.tv_nsec - from.tv_nsec);
+}
+
+/**
+ * @brief 发送全部数据
+ * @return 成功返回0, 连接出错返回-1
+ */
+int send_all(int fd, const char *data, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t ret = send(fd, data, n, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        data += ret;
+        n -= ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief 向读缓冲区中读入更多数据
+ * @return 成功返回0, 连接关闭或出错返回-1
+ */
+int conn_fill(struct conn *c)
+{
+    if (c->start == c->end)
+        c->start = c->end = 0;
+    else if (c->end == sizeof(c->buf))
+    {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+    ssize_t n;
+    do
+        n = recv(c->fd, c->buf + c->end, sizeof(c->buf) - c->end, 0);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+    c->end += n;
+    return 0;
+}
+
+/**
+ * @brief 读取一行应答
+ * @param c 连接
+ * @param line 保存去掉换行符的应答
+ * @param size line的大小
+ * @return 成功返回0, 连接出错返回-1
+ */
+int conn_read_line(struct conn *c, char *line, size_t size)
+{
+    while (true)
+    {
+        char *eol = (char *)memchr(c->buf + c->start, '\n', c->end - c->start);
+        if (eol != NULL)
+        {
+            size_t len = eol - (c->buf + c->start);
+            size_t copy = len < size - 1 ? len : size - 1;
+            memcpy(line, c->buf + c->start, copy);
+            line[copy] = '\0';
+            if (copy > 0 && line[copy - 1] == '\r')
+                line[copy - 1] = '\0';
+            c->start += len + 1;
+            return 0;
+        }
+        if (c->end - c->start == sizeof(c->buf) || conn_fill(c) < 0)
+            return -1;
+    }
+}
+
+/**
+ * @brief 读取并丢弃指定长度的数据
+ * @return 成功返回0, 连接出错返回-1
+ */
+int conn_skip(struct conn *c, long long n)
+{
+    while (n > 0)
+    {
+        if (c->start == c->end && conn_fill(c) < 0)
+            return -1;
+        size_t take = c->end - c->start;
+        if ((long long)take > n)
+            take = n;
+        c->start += take;
+        n -= take;
+    }
+    return 0;
+}
+
+/**
+ * @brief 连接到本机的服务器并读取欢迎信息
+ * @param c 连接
+ * @param port 服务器端口号
+ * @return 成功返回0, 失败返回-1
+ */
+int conn_open(struct conn *c, int port)
+{
+    c->start = c->end = 0;
+    c->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (c->fd < 0)
+        return -1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int opt = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    char line[BUFFER_SIZE];
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || conn_read_line(c, line, sizeof(line)) < 0)
+    {
+        close(c->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 下载一次文件
+ * @return 传输的字节数, 出错返回-1
+ */
+long long run_get(struct conn *c, const struct scenario *sc)
+{
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "GET get_%lld.bin\r\n", sc->param);
+    long long size;
+    if (send_all(c->fd, line, strlen(line)) < 0 || conn_read_line(c, line, sizeof(line)) < 0 ||
+        sscanf(line, "150 %lld", &size) != 1 || conn_skip(c, size) < 0 || conn_read_line(c, line, sizeof(line)) < 0 ||
+        strncmp(line, "226", 3) != 0)
+        return -1;
+    return size;
+}
+
+/**
+ * @brief 上传一次文件, 每个客户端写自己的文件
+ * @return 传输的字节数, 出错返回-1
+ */
+long long run_put(struct conn *c, const struct scenario *sc, int id)
+{
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "PUT %lld put_%d.bin\r\n", sc->param, id);
+    if (send_all(c->fd, line, strlen(line)) < 0 || send_all(c->fd, put_data, sc->param) < 0 ||
+        conn_read_line(c, line, sizeof(line)) < 0 || strncmp(line, "226", 3) != 0)
+        return -1;
+    return sc->param;
+}
+
+/**
+ * @brief 列出一次目录
+ * @return 列表的字节数, 出错返回-1
+ */
+long long run_dir(struct conn *c)
+{
+    char line[BUFFER_SIZE];
+    if (send_all(c->fd, "DIR\r\n", 5) < 0)
+        return -1;
+    long long bytes = 0;
+    while (true)
+    {
+        if (conn_read_line(c, line, sizeof(line)) < 0)
+            return -1;
+        if (strcmp(line, "END") == 0)
+            return bytes;
+        if (strncmp(line, "dir:", 4) == 0)
+            return -1;
+        bytes += strlen(line) + 2;
+    }
+}
+
+/**
+ * @brief 一次发送一批流水线SIZE命令, 再读取全部应答
+ * @return 应答的字节数, 出错返回-1
+ */
+long long run_storm(struct conn *c, const struct scenario *sc)
+{
+    static const char cmd[] = "SIZE small.bin\r\n";
+    char batch[READ_BUFFER];
+    long long depth = sc->param;
+    if (depth * (long long)(sizeof(cmd) - 1) > (long long)sizeof(batch))
+        depth = sizeof(batch) / (sizeof(cmd) - 1);
+    for (long long i = 0; i < depth; i++)
+        memcpy(batch + i * (sizeof(cmd) - 1), cmd, sizeof(cmd) - 1);
+    if (send_all(c->fd, batch, depth * (sizeof(cmd) - 1)) < 0)
+        return -1;
+
+    char line[BUFFER_SIZE];
+    long long bytes = 0;
+    for (long long i = 0; i < depth; i++)
+    {
+        if (conn_read_line(c, line, sizeof(line)) < 0 || strstr(line, "bytes") == NULL)
+            return -1;
+        bytes += strlen(line) + 2;
+    }
+    return bytes;
+}
+
+/**
+ * @brief 记录一次操作的延迟
+ */
+void record_latency(struct bench_client *cl, uint64_t ns)
+{
+    if (cl->count == cl->capacity)
+    {
+        cl->capacity = cl->capacity == 0 ? 4096 : cl->capacity * 2;
+        cl->latency = (uint64_t *)realloc(cl->latency, cl->capacity * sizeof(uint64_t));
+        if (cl->latency == NULL)
+            error("Error: out of memory");
+    }
+    cl->latency[cl->count++] = ns;
+}
+
+/**
+ * @brief 模拟客户端线程: 在截止时刻之前反复执行场景中的操作
+ * @param arg 客户端状态
+ */
+void *client_main(void *arg)
+{
+    struct bench_client *cl = (struct bench_client *)arg;
+    static __thread struct conn c;
+    if (conn_open(&c, cl->port) < 0)
+    {
+        cl->failed = 1;
+        return NULL;
+    }
+
+    // 目录场景先进入对应的目录
+    char line[BUFFER_SIZE];
+    if (cl->sc->kind == BENCH_DIR)
+    {
+        snprintf(line, sizeof(line), "CD dir_%lld\r\n", cl->sc->param);
+        if (send_all(c.fd, line, strlen(line)) < 0 || conn_read_line(&c, line, sizeof(line)) < 0)
+            cl->failed = 1;
+    }
+
+    while (!cl->failed)
+    {
+        struct timespec start = now();
+        if (start.tv_sec > cl->deadline.tv_sec || (start.tv_sec == cl->deadline.tv_sec && start.tv_nsec >= cl->deadline.tv_nsec))
+            break;
+
+        long long n;
+        if (cl->sc->kind == BENCH_GET)
+            n = run_get(&c, cl->sc);
+        else if (cl->sc->kind == BENCH_PUT)
+            n = run_put(&c, cl->sc, cl->id);
+        else if (cl->sc->kind == BENCH_DIR)
+            n = run_dir(&c);
+        else
+            n = run_storm(&c, cl->sc);
+        if (n < 0)
+        {
+            cl->failed = 1;
+            break;
+        }
+
+        record_latency(cl, elapsed_ns(start, now()));
+        cl->ops += cl->sc->kind == BENCH_STORM ? cl->sc->param : 1;
+        cl->bytes += n;
+    }
+
+    send_all(c.fd, "QUIT\r\n", 6);
+    close(c.fd);
+    return NULL;
+}
+
+/**
+ * @brief 读取进程已经使用的CPU时间
+ * @param pid 进程号
+ * @return 用户态和内核态时间之和, 单位秒; 无法读取时返回0
+ */
+double process_cpu_seconds(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    char stat[4096];
+    size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[n] = '\0';
+
+    // 进程名可能包含空格, 从最后一个')'之后开始数字段: utime和stime是第14、15个字段
+    char *p = strrchr(stat, ')');
+    unsigned long utime = 0, stime = 0;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * @brief 本进程已经使用的CPU时间
+ * @return 单位秒
+ */
+double self_cpu_seconds()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * @brief 按升序比较两个延迟
+ */
+int compare_latency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**
+ * @brief 取已排序延迟数组中的分位数
+ * @return 单位微秒
+ */
+double percentile_us(const uint64_t *sorted, size_t n, double q)
+{
+    if (n == 0)
+        return 0;
+    size_t i = (size_t)(q * (n - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+/**
+ * @brief 创建测试需要的文件: 各种大小的下载文件、各种大小的目录和SIZE使用的小文件
+ * @param workdir 服务器的工作目录
+ * @param scenarios 场景
+ * @param count 场景数
+ */
+void prepare_workdir(const char *workdir, const struct scenario *scenarios, int count)
+{
+    if (chdir(workdir) < 0)
+        error("Error: cannot enter work directory");
+
+    static char data[1 << 20];
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = rand_r(&seed) & 0xff;
+
+    int fd = open("small.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, 100) != 100)
+        error("Error: cannot create small.bin");
+    close(fd);
+
+    put_size = 0;
+    for (int i = 0; i < count; i++)
+    {
+        char name[64];
+        const struct scenario *sc = &scenarios[i];
+        if (sc->kind == BENCH_PUT && sc->param > put_size)
+            put_size = sc->param;
+        if (sc->kind == BENCH_GET)
+        {
+            snprintf(name, sizeof(name), "get_%lld.bin", sc->param);
+            fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                error("Error: cannot create test file");
+            for (long long left = sc->param; left > 0;)
+            {
+                size_t n = left < (long long)sizeof(data) ? left : sizeof(data);
+                if (write(fd, data, n) != (ssize_t)n)
+                    error("Error: cannot write test file");
+                left -= n;
+            }
+            close(fd);
+        }
+        else if (sc->kind == BENCH_DIR)
+        {
+            snprintf(name, sizeof(name), "dir_%lld", sc->param);
+            if (mkdir(name, 0755) < 0 && errno != EEXIST)
+                error("Error: cannot create test directory");
+            for (long long j = 0; j < sc->param; j++)
+            {
+                char path[128];
+                snprintf(path, sizeof(path), "%s/file_%08lld", name, j);
+                fd = open(path, O_WRONLY | O_CREAT, 0644);
+                if (fd < 0)
+                    error("Error: cannot create test directory entry");
+                close(fd);
+            }
+        }
+    }
+
+    // PUT的数据在内存中准备好, 测量时不读本地磁盘
+    put_data = (char *)malloc(put_size + 1);
+    if (put_data == NULL)
+        error("Error: out of memory");
+    for (long long off = 0; off < put_size; off += sizeof(data))
+        memcpy(put_data + off, data, put_size - off < (long long)sizeof(data) ? put_size - off : sizeof(data));
+}
+
+/**
+ * @brief 在工作目录中启动服务器, 等待它开始接受连接
+ * @param server 服务器程序的路径
+ * @param args 额外的服务器参数, 以空格分隔
+ * @param port 端口号
+ * @return 服务器的进程号
+ */
+pid_t start_server(const char *server, const char *args, int port)
+{
+    char argbuf[BUFFER_SIZE];
+    char portbuf[16];
+    char *argv[MAX_SERVER_ARGS + 3];
+    int argc = 0;
+    argv[argc++] = (char *)server;
+    snprintf(argbuf, sizeof(argbuf), "%s", args);
+    char *save = NULL;
+    for (char *tok = strtok_r(argbuf, " ", &save); tok != NULL && argc < MAX_SERVER_ARGS; tok = strtok_r(NULL, " ", &save))
+        argv[argc++] = tok;
+    snprintf(portbuf, sizeof(portbuf), "%d", port);
+    argv[argc++] = portbuf;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        error("Error: cannot start server");
+    if (pid == 0)
+    {
+        // 服务器对每条命令都会打印日志, 丢弃输出, 不让终端成为瓶颈
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(server, argv);
+        _exit(127);
+    }
+
+    for (int i = 0; i < 200; i++)
+    {
+        static struct conn c;
+        if (conn_open(&c, port) == 0)
+        {
+            send_all(c.fd, "QUIT\r\n", 6);
+            close(c.fd);
+            return pid;
+        }
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            break;
+        usleep(20000);
+    }
+    kill(pid, SIGKILL);
+    fprintf(stderr, "Error: server '%s' did not start on port %d\n", server, port);
+    exit(1);
+}
+
+/**
+ * @brief 删除目录树中的一项, 供nftw调用
+ */
+int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    remove(path);
+    return 0;
+}
+
+/**
+ * @brief 运行一个场景并以一行JSON输出结果
+ * @param sc 场景
+ * @param clients 并发客户端数
+ * @param seconds 运行时间
+ * @param port 服务器端口号
+ * @param server 服务器进程号
+ */
+void run_scenario(const struct scenario *sc, int clients, int seconds, int port, pid_t server)
+{
+    static struct bench_client cl[MAX_CLIENTS];
+    pthread_t threads[MAX_CLIENTS];
+    struct timespec start = now();
+    double server_cpu = process_cpu_seconds(server);
+    double self_cpu = self_cpu_seconds();
+
+    for (int i = 0; i < clients; i++)
+    {
+        memset(&cl[i], 0, sizeof(cl[i]));
+        cl[i].sc = sc;
+        cl[i].id = i;
+        cl[i].port = port;
+        cl[i].deadline = start;
+        cl[i].deadline.tv_sec += seconds;
+        if (pthread_create(&threads[i], NULL, client_main, &cl[i]) != 0)
+            error("Error: cannot create client thread");
+    }
+
+    long long ops = 0, bytes = 0;
+    size_t total = 0;
+    int failed = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ops += cl[i].ops;
+        bytes += cl[i].bytes;
+        total += cl[i].count;
+        failed += cl[i].failed;
+    }
+    double wall = elapsed_ns(start, now()) / 1e9;
+    server_cpu = process_cpu_seconds(server) - server_cpu;
+    self_cpu = self_cpu_seconds() - self_cpu;
+
+    uint64_t *all = (uint64_t *)malloc((total + 1) * sizeof(uint64_t));
+    if (all == NULL)
+        error("Error: out of memory");
+    size_t n = 0;
+    for (int i = 0; i < clients; i++)
+    {
+        memcpy(all + n, cl[i].latency, cl[i].count * sizeof(uint64_t));
+        n += cl[i].count;
+        free(cl[i].latency);
+    }
+    qsort(all, n, sizeof(uint64_t), compare_latency);
+
+    const char *kinds[] = {"get", "put", "dir", "storm"};
+    double gb = bytes / 1e9;
+    printf("{\"scenario\":\"%s\",\"kind\":\"%s\",\"param\":%lld,\"clients\":%d,\"seconds\":%.3f,"
+           "\"ops\":%lld,\"ops_per_sec\":%.1f,\"bytes\":%lld,\"mb_per_sec\":%.2f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+           "\"server_cpu_sec\":%.3f,\"client_cpu_sec\":%.3f,\"server_cpu_sec_per_gb\":%.3f,\"errors\":%d}\n",
+           sc->name, kinds[sc->kind], sc->param, clients, wall,
+           ops, ops / wall, bytes, bytes / wall / 1e6,
+           percentile_us(all, n, 0.50), percentile_us(all, n, 0.99), percentile_us(all, n, 0.999), n > 0 ? all[n - 1] / 1000.0 : 0.0,
+           server_cpu, self_cpu, gb > 0 ? server_cpu / gb : 0.0, failed);
+    fflush(stdout);
+    free(all);
+}
+
+/**
+ * @brief 输出用法
+ */
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-S server] [-a \"server args\"] [-p port] [-c clients] [-t seconds] [-k] [scenario...]\n", prog);
+    fprintf(stderr, "Scenarios: get:<size> put:<size> dir:<entries> storm:<depth>, sizes accept k/m/g suffixes\n");
+    fprintf(stderr, "Default: get:4k get:1m get:64m put:1m dir:1000 dir:100000 storm:32\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server = "./server";
+    const char *server_args = "";
+    int port = DEFAULT_PORT;
+    int clients = DEFAULT_CLIENTS;
+    int seconds = DEFAULT_SECONDS;
+    bool keep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "S:a:p:c:t:k")) != -1)
+    {
+        switch (opt)
+        {
+        case 'S':
+            server = optarg;
+            break;
+        case 'a':
+            server_args = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'k':
+            // 保留工作目录, 便于检查
+            keep = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (clients <= 0 || clients > MAX_CLIENTS || seconds <= 0 || port <= 0)
+        usage(argv[0]);
+
+    static const char *defaults[] = {"get:4k", "get:1m", "get:64m", "put:1m", "dir:1000", "dir:100000", "storm:32"};
+    struct scenario scenarios[MAX_SCENARIOS];
+    int count = 0;
+    int ndefaults = sizeof(defaults) / sizeof(defaults[0]);
+    for (int i = optind; i < argc || (optind == argc && count < ndefaults); i++)
+    {
+        const char *text = optind == argc ? defaults[count] : argv[i];
+        if (count == MAX_SCENARIOS || parse_scenario(text, &scenarios[count]) < 0)
+            usage(argv[0]);
+        count++;
+    }
+
+    // 服务器在临时目录中运行, 路径需要在切换目录之前转换为绝对路径
+    char server_path[PATH_MAX];
+    if (realpath(server, server_path) == NULL)
+        error("Error: cannot find server binary");
+    char workdir[] = "/tmp/ftp-bench.XXXXXX";
+    if (mkdtemp(workdir) == NULL)
+        error("Error: cannot create work directory");
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Preparing %s...\n", workdir);
+    prepare_workdir(workdir, scenarios, count);
+    pid_t pid = start_server(server_path, server_args, port);
+
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(stderr, "Running %s with %d clients for %d s...\n", scenarios[i].name, clients, seconds);
+        run_scenario(&scenarios[i], clients, seconds, port, pid);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    if (!keep)
+        nftw(workdir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    free(put_data);
+    return 0;
+}
@@ -1,19 +1,121 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <dirent.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
+#include <glob.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 #define BUFFER_SIZE 1024
+#define TRANSFER_CHUNK (64 * 1024)
+#define MAX_STRIPES 64
+#define MAX_POOL 64
+#define DEFAULT_POOL 4
+#define PIPELINE_DEPTH 4
+#define PIPELINE_BUFFER (256 * 1024)
+#define FRAME_BLOCK (256 * 1024)
+// 数据块头部只有最高位一个标志位: MODE Z中表示数据未压缩, 增量上传中表示引用原有文件的一块, 其余位是长度或块号
+#define FRAME_FLAG 0x80000000u
+#define FRAME_STORED FRAME_FLAG
+#define FRAME_COPY FRAME_FLAG
+#define INCOMPRESSIBLE_LIMIT 2
+#define DELTA_MIN_BLOCK 1024
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define PROGRESS_INTERVAL_MS 200
+#define TRANSFER_TIMEOUT 60
+
+// MODE Z的压缩级别, 0表示不压缩
+int transfer_level = 0;
+
+/**
+ * @brief CRC32C (Castagnoli) 查找表, 在启动时初始化
+ */
+static uint32_t crc32c_table[256];
+
+/**
+ * @brief 用查找表逐字节计算CRC32C
+ * @param crc 当前的校验和
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 更新后的校验和
+ */
+uint32_t crc32c_sw(uint32_t crc, const char *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    while (n-- > 0)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief 用SSE4.2的crc32指令计算CRC32C, 每条指令处理8个字节
+ * @param crc 当前的校验和
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 更新后的校验和
+ */
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const char *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    while (n > 0 && ((uintptr_t)p & 7) != 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        n--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; n >= 8; n -= 8, p += 8)
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+    crc = (uint32_t)crc64;
+#endif
+    for (; n > 0; n--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/**
+ * @brief 根据CPU支持的指令集选择的CRC32C实现
+ */
+static uint32_t (*crc32c_update)(uint32_t, const char *, size_t) = crc32c_sw;
+
+/**
+ * @brief 初始化CRC32C查找表并选择实现
+ */
+void crc32c_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_hw;
+#endif
+}
 
 /**
  * @brief 输出错误信息并退出程序
@@ -25,16 +127,249 @@ void error(const char *msg)
     exit(1);
 }
 
+/**
+ * @brief 接收服务器的一行应答, 不会读走该行之后的数据
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param size 缓冲区大小
+ * @return 成功返回应答的长度, 连接关闭或出错返回-1
+ */
+int recv_line(int sockfd, char *buffer, size_t size)
+{
+    size_t len = 0;
+    while (len < size - 1)
+    {
+        // 先窥探数据找到行尾, 再只取走这一行
+        int n = recv(sockfd, buffer + len, size - 1 - len, MSG_PEEK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        char *eol = (char *)memchr(buffer + len, '\n', n);
+        int take = eol != NULL ? eol - (buffer + len) + 1 : n;
+        if (recv(sockfd, buffer + len, take, 0) != take)
+            return -1;
+        len += take;
+        if (eol != NULL)
+            break;
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+/**
+ * @brief 接收服务器的一行应答, 连接关闭或等待超时时退出
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针, 大小为BUFFER_SIZE
+ */
+void recv_reply(int sockfd, char *buffer)
+{
+    if (recv_line(sockfd, buffer, BUFFER_SIZE) >= 0)
+        return;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        error("Error: timed out waiting for server reply");
+    error("FTP server closed connection");
+}
+
+/**
+ * @brief 设置套接字的接收超时
+ * @param sockfd 套接字文件描述符
+ * @param timeout 超时时间, 为0表示一直等待
+ * @param saved 保存原来的超时, 用于之后恢复; 不需要时为NULL
+ */
+void set_recv_timeout(int sockfd, struct timeval timeout, struct timeval *saved)
+{
+    if (saved != NULL)
+    {
+        socklen_t optlen = sizeof(*saved);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, saved, &optlen) < 0)
+            memset(saved, 0, sizeof(*saved));
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * @brief 发送缓冲区中的全部数据
+ * @param sockfd 套接字文件描述符
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 成功返回0, 出错返回-1
+ */
+int send_all(int sockfd, const char *data, size_t n)
+{
+    while (n > 0)
+    {
+        int ret = send(sockfd, data, n, MSG_NOSIGNAL);
+        if (ret <= 0)
+            return -1;
+        data += ret;
+        n -= ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief 从服务器接收正好n个字节
+ * @param sockfd 套接字文件描述符
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 成功返回0, 连接关闭或出错返回-1
+ */
+int recv_all(int sockfd, char *data, size_t n)
+{
+    while (n > 0)
+    {
+        int ret = recv(sockfd, data, n, 0);
+        if (ret <= 0)
+            return -1;
+        data += ret;
+        n -= ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief 按MODE Z的格式压缩并发送文件数据: 每个数据块是4字节网络字节序头部加数据,
+ *        头部最高位表示数据未压缩, 长度为0的块表示结束
+ * @param sockfd 套接字文件描述符
+ * @param infile 本地文件
+ * @param left 要发送的原始字节数
+ */
+void send_compressed_file(int sockfd, FILE *infile, long long left)
+{
+    static char data[FRAME_BLOCK];
+    static char frame[4 + FRAME_BLOCK + FRAME_BLOCK / 1000 + 64];
+    int stored = 0;
+    long long raw = 0, sent = 0;
+    while (left > 0)
+    {
+        int n = fread(data, sizeof(char), left < FRAME_BLOCK ? left : FRAME_BLOCK, infile);
+        if (n <= 0)
+            error("Error: cannot read local file");
+
+        // 连续几个数据块都压缩不了时认为文件已经压缩过, 剩余部分不再经过压缩
+        uLongf len = sizeof(frame) - 4;
+        uint32_t header;
+        if (stored < INCOMPRESSIBLE_LIMIT &&
+            compress2((Bytef *)frame + 4, &len, (const Bytef *)data, n, transfer_level) == Z_OK && len < (uLongf)n)
+        {
+            stored = 0;
+            header = htonl(len);
+        }
+        else
+        {
+            stored++;
+            memcpy(frame + 4, data, n);
+            len = n;
+            header = htonl(len | FRAME_STORED);
+        }
+        memcpy(frame, &header, 4);
+        if (send_all(sockfd, frame, 4 + len) < 0)
+            error("Error sending file to server");
+        left -= n;
+        raw += n;
+        sent += 4 + len;
+    }
+
+    uint32_t end = 0;
+    if (send_all(sockfd, (const char *)&end, 4) < 0)
+        error("Error sending file to server");
+    printf("Sent %lld bytes as %lld compressed bytes.\n", raw, sent + 4);
+}
+
+/**
+ * @brief 按MODE Z的格式接收并解压文件数据, 解压后的长度必须等于声明的长度
+ * @param sockfd 套接字文件描述符
+ * @param outfile 本地文件
+ * @param size 解压后的数据长度
+ */
+void recv_compressed_file(int sockfd, FILE *outfile, long long size)
+{
+    static char data[FRAME_BLOCK];
+    static char frame[FRAME_BLOCK + FRAME_BLOCK / 1000 + 64];
+    long long raw = 0, received = 0;
+    while (true)
+    {
+        uint32_t header;
+        if (recv_all(sockfd, (char *)&header, 4) < 0)
+            error("FTP server closed connection");
+        header = ntohl(header);
+        uint32_t len = header & ~FRAME_FLAG;
+        if (len == 0)
+            break;
+        if (len > sizeof(frame) || recv_all(sockfd, frame, len) < 0)
+            error("Error receiving compressed data from server");
+
+        uLongf n = sizeof(data);
+        if (header & FRAME_STORED)
+        {
+            memcpy(data, frame, len);
+            n = len;
+        }
+        else if (uncompress((Bytef *)data, &n, (const Bytef *)frame, len) != Z_OK)
+        {
+            error("Error: corrupt compressed data");
+        }
+        if (raw + (long long)n > size)
+            error("Error: server sent more data than announced");
+        if (fwrite(data, sizeof(char), n, outfile) != n)
+            error("Error: cannot write local file");
+        raw += n;
+        received += 4 + len;
+    }
+    if (raw != size)
+        error("Error: compressed transfer ended before the announced size");
+    printf("Received %lld bytes as %lld compressed bytes.\n", raw, received + 4);
+}
+
+/**
+ * @brief 设置传输模式
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param mode "s"不压缩, "z"压缩
+ * @param level 压缩级别, 0表示使用默认级别
+ */
+void set_transfer_mode(int sockfd, char *buffer, const char *mode, int level)
+{
+    memset(buffer, 0, BUFFER_SIZE);
+    if (level > 0)
+        sprintf(buffer, "MODE %s %d\r\n", mode, level);
+    else
+        sprintf(buffer, "MODE %s\r\n", mode);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+
+    recv_reply(sockfd, buffer);
+    printf("%s", buffer);
+
+    // 服务器接受后才切换本地的模式
+    int zlevel;
+    if (sscanf(buffer, "200 Mode set to Z, level %d", &zlevel) == 1)
+        transfer_level = zlevel;
+    else if (strncmp(buffer, "200", 3) == 0)
+        transfer_level = 0;
+}
+
 /**
  * @brief 显示帮助信息
  */
 void display_help_info()
 {
     printf("get <arg> - download a file from the server\n");
+    printf("get -j <n> <arg> - download a file over n parallel connections\n");
     printf("put <arg> - upload a file to the server\n");
+    printf("put -s <arg> - upload a file unless the server already has an identical copy\n");
+    printf("put -d <arg> - update the copy on the server by sending only the changed blocks\n");
+    printf("verify <arg> - compare the checksum of a local file with the copy on the server\n");
+    printf("mode z [1-9] - compress get/put transfers; mode s - send them uncompressed\n");
+    printf("mget [-j n] <pattern>... - download all matching files from the server over n connections\n");
+    printf("mput [-j n] <pattern>... - upload all matching local files over n connections\n");
+    printf("reget <arg> - resume downloading a file from the end of the local copy\n");
+    printf("reput <arg> - resume uploading a file from the end of the remote copy\n");
     printf("pwd - display the current directory on the server\n");
     printf("dir - list the files in the current directory on the server\n");
+    printf("mls [pattern] [sort=[-]name|size|mtime] [limit=N] [cursor=C] - list matching files as key=value facts\n");
     printf("cd <directory> - change the current directory on the server\n");
+    printf("stat - show server statistics: sessions, traffic and command latencies\n");
     printf("!pwd - display the current directory on the client\n");
     printf("!dir - list the files in the current directory on the client\n");
     printf("!cd <directory> - change the current directory on the client\n");
@@ -78,6 +413,26 @@ void show_remote_system_type(int sockfd, char *buffer)
     printf("%s", buffer);
 }
 
+/**
+ * @brief 显示服务器的统计信息, 应答有多行, 以"211 "开头的行结束
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ */
+void show_remote_status(int sockfd, char *buffer)
+{
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "STAT\r\n");
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+
+    while (true)
+    {
+        recv_reply(sockfd, buffer);
+        printf("%s", buffer);
+        if (strncmp(buffer, "211-", 4) != 0 && buffer[0] != ' ')
+            break;
+    }
+}
+
 /**
  * @brief 显示远程服务器端指定文件的大小
  * @param sockfd socket文件描述符
@@ -210,11 +565,11 @@ void show_remote_directory_info(int sockfd, char *buffer)
     sprintf(buffer, "DIR\r\n");
     send(sockfd, buffer, strlen(buffer), 0);
 
+    // 设置接收超时时间为 0.5 秒, 列出目录之后恢复原来的超时, 不影响之后等待应答的命令
+    struct timeval saved_timeout, time_out = {0, 500000};
+    set_recv_timeout(sockfd, time_out, &saved_timeout);
     while (true)
     {
-        // 设置接收超时时间为 0.5 秒
-        struct timeval time_out = {0, 500000};
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&time_out, sizeof(time_out));
         // 接收当前目录信息
         memset(buffer, 0, BUFFER_SIZE);
         int n = recv(sockfd, buffer, BUFFER_SIZE, 0);
@@ -234,6 +589,39 @@ void show_remote_directory_info(int sockfd, char *buffer)
         }
         printf("%s", buffer);
     }
+    set_recv_timeout(sockfd, saved_timeout, NULL);
+}
+
+/**
+ * @brief 显示服务器端机器可读的目录列表
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param args 过滤、排序和分页参数
+ */
+void show_remote_machine_list(int sockfd, char *buffer, const char *args)
+{
+    // 先复制参数, buffer会被后续的应答覆盖
+    char query[BUFFER_SIZE];
+    snprintf(query, sizeof(query), "%s", args);
+    memset(buffer, 0, BUFFER_SIZE);
+    snprintf(buffer, BUFFER_SIZE, "MLSD %.1000s\r\n", query);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+
+    while (true)
+    {
+        recv_reply(sockfd, buffer);
+        if (strncmp(buffer, "END", 3) == 0)
+        {
+            // 服务器还有更多目录项时返回下一页的游标
+            char cursor[BUFFER_SIZE];
+            if (sscanf(buffer, "END %s", cursor) == 1)
+                printf("-- more entries, next page: cursor=%s\n", cursor);
+            break;
+        }
+        printf("%s", buffer);
+        if (strncmp(buffer, "type=", 5) != 0)
+            break;
+    }
 }
 
 /**
@@ -266,160 +654,1406 @@ void show_remote_directory_path(int sockfd, char *buffer)
 }
 
 /**
- * @brief 上传文件到服务器
- * @param sockfd 套接字文件描述符
- * @param buffer 缓冲区指针
- * @param filename 文件名
+ * @brief 网络和磁盘之间的缓冲区环: 生产者填满一个缓冲区后交给消费者, 两边同时工作,
+ *        最多占用PIPELINE_DEPTH个缓冲区的内存
  */
-void upload_file(int sockfd, char *buffer, const char *filename)
+struct io_pipeline
 {
-    // 发送上传文件的命令
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "PUT %s\r\n", filename);
-    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
-
-    // 打开本地文件
-    FILE *infile = fopen(filename, "rb");
-    if (infile == NULL)
-        error("Error: cannot open local file.");
+    pthread_mutex_t lock;          // 保护下面的字段
+    pthread_cond_t changed;        // 有缓冲区被填满或被释放
+    char *data[PIPELINE_DEPTH];    // 缓冲区
+    size_t len[PIPELINE_DEPTH];    // 每个缓冲区中的数据长度
+    int head;                      // 下一个要消费的缓冲区
+    int count;                     // 已经填满、等待消费的缓冲区数
+    int closed;                    // 生产者已经结束
+    int failed;                    // 任意一方出错, 另一方应尽快停止
+};
 
-    // 发送文件数据
-    int n;
-    while ((n = fread(buffer, sizeof(char), BUFFER_SIZE, infile)) > 0)
+/**
+ * @brief 初始化缓冲区环
+ * @param p 缓冲区环
+ */
+void pipeline_init(struct io_pipeline *p)
+{
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
     {
-        send(sockfd, buffer, n, 0);
-        printf("Sent %d bytes.\n", n);
+        p->data[i] = (char *)malloc(PIPELINE_BUFFER);
+        if (p->data[i] == NULL)
+            error("Error: out of memory");
+        p->len[i] = 0;
     }
+    p->head = 0;
+    p->count = 0;
+    p->closed = 0;
+    p->failed = 0;
+}
 
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "EOF\r\n");
-    send(sockfd, buffer, strlen(buffer), 0);
+/**
+ * @brief 释放缓冲区环
+ * @param p 缓冲区环
+ */
+void pipeline_destroy(struct io_pipeline *p)
+{
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+        free(p->data[i]);
+    pthread_cond_destroy(&p->changed);
+    pthread_mutex_destroy(&p->lock);
+}
 
-    fclose(infile);
+/**
+ * @brief 生产者等待一个空闲的缓冲区
+ * @param p 缓冲区环
+ * @return 缓冲区, 消费者出错时返回NULL
+ */
+char *pipeline_acquire(struct io_pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->count == PIPELINE_DEPTH && !p->failed)
+        pthread_cond_wait(&p->changed, &p->lock);
+    char *data = p->failed ? NULL : p->data[(p->head + p->count) % PIPELINE_DEPTH];
+    pthread_mutex_unlock(&p->lock);
+    return data;
+}
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sockfd, buffer, BUFFER_SIZE, 0);
-    if (strstr(buffer, "550 Failed to create file") != NULL)
-    {
-        printf("Failed to upload file.\n");
-        return;
-    }
-    else if (strstr(buffer, "226 Transfer complete") != NULL)
+/**
+ * @brief 生产者交出填好的缓冲区
+ * @param p 缓冲区环
+ * @param n 缓冲区中的数据长度
+ */
+void pipeline_commit(struct io_pipeline *p, size_t n)
+{
+    pthread_mutex_lock(&p->lock);
+    p->len[(p->head + p->count) % PIPELINE_DEPTH] = n;
+    p->count++;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * @brief 结束缓冲区环, 生产者不再提供数据或一方出错
+ * @param p 缓冲区环
+ * @param failed 是否因为出错而结束
+ */
+void pipeline_close(struct io_pipeline *p, int failed)
+{
+    pthread_mutex_lock(&p->lock);
+    p->closed = 1;
+    if (failed)
+        p->failed = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * @brief 消费者等待下一个填满的缓冲区, 用完后调用pipeline_release
+ * @param p 缓冲区环
+ * @param data 保存缓冲区
+ * @return 数据长度, 生产者已经结束或出错时返回0
+ */
+size_t pipeline_next(struct io_pipeline *p, char **data)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->count == 0 && !p->closed && !p->failed)
+        pthread_cond_wait(&p->changed, &p->lock);
+    size_t n = 0;
+    if (p->count > 0 && !p->failed)
     {
-        printf("File uploaded successfully.\n");
+        *data = p->data[p->head];
+        n = p->len[p->head];
     }
+    pthread_mutex_unlock(&p->lock);
+    return n;
 }
 
 /**
- * @brief 下载服务器端文件到本地
- * @param sockfd 套接字文件描述符
- * @param buffer 缓冲区指针
- * @param filename 文件名
+ * @brief 消费者归还用完的缓冲区
+ * @param p 缓冲区环
  */
-void download_file(int sockfd, char *buffer, const char *filename)
+void pipeline_release(struct io_pipeline *p)
 {
-    // 发送下载文件的命令
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "GET %s\r\n", filename);
-    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    pthread_mutex_lock(&p->lock);
+    p->head = (p->head + 1) % PIPELINE_DEPTH;
+    p->count--;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
 
-    // 创建本地文件
-    FILE *outfile = fopen(filename, "wb");
-    if (outfile == NULL)
-        error("Error: cannot create local file");
+/**
+ * @brief 磁盘一侧的线程参数
+ */
+struct disk_stage
+{
+    struct io_pipeline *p; // 缓冲区环
+    FILE *file;            // 本地文件
+    long long left;        // 上传时要读取的字节数
+};
 
-    // 接收文件数据
-    int n;
-    while (true)
+/**
+ * @brief 上传时的读文件线程, 把文件内容依次填入缓冲区环
+ * @param arg 磁盘一侧的线程参数
+ */
+void *disk_reader(void *arg)
+{
+    struct disk_stage *st = (struct disk_stage *)arg;
+    while (st->left > 0)
     {
-        // 使用select函数等待socket变为可读
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(sockfd, &read_fds);
+        char *data = pipeline_acquire(st->p);
+        if (data == NULL)
+            return NULL;
+        size_t n = fread(data, sizeof(char), st->left < PIPELINE_BUFFER ? st->left : PIPELINE_BUFFER, st->file);
+        if (n == 0)
+        {
+            pipeline_close(st->p, 1);
+            return NULL;
+        }
+        pipeline_commit(st->p, n);
+        st->left -= n;
+    }
+    pipeline_close(st->p, 0);
+    return NULL;
+}
 
-        // 设置超时时间为1秒
-        struct timeval timeout = {1, 0};
-        /**
-         * select函数用于等待socket变为可读.
-         * 第一个参数为最大的socket文件描述符加1.
-         * 第二个参数为可读的socket集合.
-         * 第三个参数为可写的socket集合.
-         * 第四个参数为异常的socket集合.
-         * 第五个参数为超时时间.
-         * 返回值为可读的socket数量.
-         */
-        int ret = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
-        if (ret == -1)
-            error("Error: select function failed");
-        else if (ret == 0)
-            error("Timeout");
-        else
+/**
+ * @brief 下载时的写文件线程, 把缓冲区环中的数据依次写入文件
+ * @param arg 磁盘一侧的线程参数
+ */
+void *disk_writer(void *arg)
+{
+    struct disk_stage *st = (struct disk_stage *)arg;
+    char *data;
+    size_t n;
+    while ((n = pipeline_next(st->p, &data)) > 0)
+    {
+        if (fwrite(data, sizeof(char), n, st->file) != n)
         {
-            // socket变为可读，使用recv函数接收数据
-            n = recv(sockfd, buffer, BUFFER_SIZE, 0);
-            if (n == -1)
-                error("Error receiving message from server");
-            else if (n == 0)
-                error("FTP server closed connection");
-            else
-            {
-                // 接收到了数据
-                buffer[n] = '\0';
-                if (strstr(buffer, "550 Failed to open file") != NULL)
-                {
-                    printf("Failed to download file.\n");
-                    return;
-                }
-                if (strstr(buffer, "EOF") != NULL)
-                {
-                    char *p = strstr(buffer, "EOF");
-                    fwrite(buffer, sizeof(char), p - buffer, outfile);
-                    printf("Received %ld bytes.\n", p - buffer);
-                    break;
-                }
-                fwrite(buffer, sizeof(char), n, outfile);
-                printf("Received %d bytes.\n", n);
-            }
+            pipeline_close(st->p, 1);
+            return NULL;
         }
+        pipeline_release(st->p);
     }
+    return NULL;
+}
 
-    fclose(outfile);
+/**
+ * @brief 传输进度显示, 最多每PROGRESS_INTERVAL_MS毫秒刷新一次同一行;
+ *        标准输出不是终端时只在结束时输出一行汇总
+ */
+struct progress
+{
+    const char *verb;      // 显示的动作, 例如"Sent"
+    long long total;       // 要传输的字节数
+    long long done;        // 已经传输的字节数
+    struct timespec start; // 开始的时刻
+    struct timespec shown; // 上次刷新的时刻
+    int tty;               // 标准输出是否为终端
+};
 
-    printf("File downloaded successfully.\n");
+/**
+ * @brief 计算两个时刻之间的秒数
+ */
+double seconds_between(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
 }
 
 /**
- * @brief 连接到服务器
- * @param hostname 服务器主机名
- * @param port 服务器端口号
- * @return 套接字文件描述符
+ * @brief 开始显示一次传输的进度
+ * @param p 进度
+ * @param verb 显示的动作
+ * @param total 要传输的字节数
  */
-int connect_to_server(const char *hostname, int port)
+void progress_start(struct progress *p, const char *verb, long long total)
 {
-    // 创建socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sockfd < 0)
-        error("Error: cannot create socket.");
+    p->verb = verb;
+    p->total = total;
+    p->done = 0;
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    p->shown = p->start;
+    p->tty = isatty(STDOUT_FILENO);
+}
 
-    // 获取服务器的IP地址
-    struct hostent *he = gethostbyname(hostname);
-    if (he == NULL)
-        error("Error: cannot get server IP address.");
+/**
+ * @brief 记录传输的字节数, 距离上次刷新足够久时显示进度、速度和预计剩余时间
+ * @param p 进度
+ * @param n 新传输的字节数
+ */
+void progress_update(struct progress *p, long long n)
+{
+    p->done += n;
+    if (!p->tty)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (seconds_between(p->shown, now) * 1000 < PROGRESS_INTERVAL_MS)
+        return;
+    p->shown = now;
 
-    // 设置服务器的地址和端口号
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr = *((struct in_addr *)he->h_addr);
+    double elapsed = seconds_between(p->start, now);
+    double rate = elapsed > 0 ? p->done / elapsed : 0;
+    long eta = rate > 0 ? (long)((p->total - p->done) / rate) : 0;
+    printf("\r%s %lld/%lld bytes (%.0f%%), %.1f MB/s, ETA %ld:%02ld ", p->verb, p->done, p->total,
+           p->total > 0 ? 100.0 * p->done / p->total : 100.0, rate / 1e6, eta / 60, eta % 60);
+    fflush(stdout);
+}
 
-    // 连接服务器
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+/**
+ * @brief 结束进度显示, 输出总字节数、用时和平均速度
+ * @param p 进度
+ */
+void progress_finish(struct progress *p)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = seconds_between(p->start, now);
+    if (p->tty)
+        printf("\r\033[K");
+    printf("%s %lld bytes in %.2f s (%.1f MB/s).\n", p->verb, p->done, elapsed, elapsed > 0 ? p->done / elapsed / 1e6 : 0.0);
+}
+
+/**
+ * @brief 上传文件到服务器
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ * @param offset 从该偏移开始上传, 服务器保留文件中该偏移之前的内容
+ */
+void upload_file(int sockfd, char *buffer, const char *filename, long long offset)
+{
+    // 打开本地文件
+    FILE *infile = fopen(filename, "rb");
+    struct stat file_stat;
+    if (infile == NULL || fstat(fileno(infile), &file_stat) < 0)
+    {
+        printf("put: cannot open '%s': No such file or directory\n", filename);
+        if (infile != NULL)
+            fclose(infile);
+        return;
+    }
+    if (offset > file_stat.st_size || fseeko(infile, offset, SEEK_SET) < 0)
+    {
+        printf("put: remote file is longer than '%s'\n", filename);
+        fclose(infile);
+        return;
+    }
+
+    // 续传时先设置起始偏移
+    if (offset > 0)
+    {
+        memset(buffer, 0, BUFFER_SIZE);
+        sprintf(buffer, "REST %lld\r\n", offset);
+        send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+        recv_reply(sockfd, buffer);
+    }
+
+    // 发送上传文件的命令, 声明数据长度后紧跟文件数据
+    long long left = file_stat.st_size - offset;
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "PUT %lld %s\r\n", left, filename);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+
+    // 发送文件数据, 正好发送声明的长度
+    if (transfer_level > 0)
+    {
+        send_compressed_file(sockfd, infile, left);
+        left = 0;
+    }
+    if (left > 0)
+    {
+        // 读文件线程提前读入后面的数据, 发送和读盘同时进行
+        struct io_pipeline p;
+        pipeline_init(&p);
+        struct disk_stage st = {&p, infile, left};
+        pthread_t reader;
+        if (pthread_create(&reader, NULL, disk_reader, &st) != 0)
+            error("Error: cannot create reader thread");
+        char *data;
+        size_t n;
+        struct progress pr;
+        progress_start(&pr, "Sent", left);
+        while ((n = pipeline_next(&p, &data)) > 0)
+        {
+            if (send_all(sockfd, data, n) < 0)
+                error("Error sending file to server");
+            pipeline_release(&p);
+            left -= n;
+            progress_update(&pr, n);
+        }
+        progress_finish(&pr);
+        pthread_join(reader, NULL);
+        pipeline_destroy(&p);
+        if (left > 0)
+            error("Error: cannot read local file");
+    }
+
+    fclose(infile);
+
+    recv_reply(sockfd, buffer);
+    if (strncmp(buffer, "226", 3) == 0)
+        printf("File uploaded successfully.\n");
+    else
+        printf("Failed to upload file.\n");
+}
+
+/**
+ * @brief 接收未压缩的文件数据, 正好接收声明的长度; 写文件线程同时把已经收到的缓冲区写入磁盘
+ * @param sockfd 套接字文件描述符
+ * @param outfile 本地文件
+ * @param size 数据长度
+ */
+void recv_plain_file(int sockfd, FILE *outfile, long long size)
+{
+    long long left = size;
+    struct io_pipeline p;
+    pipeline_init(&p);
+    struct disk_stage st = {&p, outfile, 0};
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, disk_writer, &st) != 0)
+        error("Error: cannot create writer thread");
+    char *data = NULL;
+    size_t filled = 0;
+    struct progress pr;
+    progress_start(&pr, "Received", left);
+    while (left > 0)
+    {
+        if (data == NULL && (data = pipeline_acquire(&p)) == NULL)
+            error("Error: cannot write local file");
+
+        // 使用recv函数接收数据, 缓冲区填满或数据收完后交给写文件线程
+        size_t room = PIPELINE_BUFFER - filled;
+        int n = recv(sockfd, data + filled, left < (long long)room ? left : room, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            error("Error: no data from server, transfer timed out");
+        else if (n == -1)
+            error("Error receiving message from server");
+        else if (n == 0)
+            error("FTP server closed connection");
+        filled += n;
+        left -= n;
+        progress_update(&pr, n);
+        if (filled == PIPELINE_BUFFER || left == 0)
+        {
+            pipeline_commit(&p, filled);
+            data = NULL;
+            filled = 0;
+        }
+    }
+    progress_finish(&pr);
+    pipeline_close(&p, 0);
+    pthread_join(writer, NULL);
+    int failed = p.failed;
+    pipeline_destroy(&p);
+    if (failed)
+        error("Error: cannot write local file");
+}
+
+/**
+ * @brief 下载服务器端文件到本地
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ * @param offset 从该偏移开始下载, 追加到本地文件末尾
+ */
+void download_file(int sockfd, char *buffer, const char *filename, long long offset)
+{
+    // 续传时先设置起始偏移
+    if (offset > 0)
+    {
+        memset(buffer, 0, BUFFER_SIZE);
+        sprintf(buffer, "REST %lld\r\n", offset);
+        send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+        recv_reply(sockfd, buffer);
+    }
+
+    // 发送下载文件的命令
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "GET %s\r\n", filename);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+
+    // 服务器先应答剩余的长度
+    long long size;
+    recv_reply(sockfd, buffer);
+    if (sscanf(buffer, "150 %lld", &size) != 1)
+    {
+        printf("Failed to download file.\n");
+        return;
+    }
+
+    // 创建本地文件, 续传时追加到已有内容之后
+    FILE *outfile = fopen(filename, offset > 0 ? "ab" : "wb");
+    if (outfile == NULL)
+        error("Error: cannot create local file");
+
+    // 传输停滞超过TRANSFER_TIMEOUT秒时recv返回EAGAIN, 不必在每次recv之前调用select; 结束后恢复原来的超时
+    struct timeval saved_timeout, stall_timeout = {TRANSFER_TIMEOUT, 0};
+    set_recv_timeout(sockfd, stall_timeout, &saved_timeout);
+
+    // MODE Z中边接收边解压并同步写入文件, 否则由写文件线程把已经收到的缓冲区写入磁盘
+    if (transfer_level > 0)
+        recv_compressed_file(sockfd, outfile, size);
+    else
+        recv_plain_file(sockfd, outfile, size);
+    set_recv_timeout(sockfd, saved_timeout, NULL);
+
+    if (fclose(outfile) != 0)
+        error("Error: cannot write local file");
+
+    // 文件数据之后是传输完成的应答
+    recv_reply(sockfd, buffer);
+    if (strncmp(buffer, "226", 3) == 0)
+        printf("File downloaded successfully.\n");
+    else
+        printf("Failed to download file.\n");
+}
+
+/**
+ * @brief 连接到服务器
+ * @param hostname 服务器主机名
+ * @param port 服务器端口号
+ * @return 套接字文件描述符
+ */
+int connect_to_server(const char *hostname, int port)
+{
+    // 创建socket
+    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sockfd < 0)
+        error("Error: cannot create socket.");
+
+    // 获取服务器的IP地址
+    struct hostent *he = gethostbyname(hostname);
+    if (he == NULL)
+        error("Error: cannot get server IP address.");
+
+    // 设置服务器的地址和端口号
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr = *((struct in_addr *)he->h_addr);
+
+    // 连接服务器
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
         error("Error: cannot connect to server.");
 
+    // 命令之后紧跟的文件数据不必等待服务器对命令的延迟确认
+    int opt = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
     return sockfd;
 }
 
+/**
+ * @brief 并行下载中一个连接负责的文件范围
+ */
+struct stripe
+{
+    int sockfd;           // 该范围使用的连接
+    int fd;               // 本地文件描述符
+    const char *cwd;      // 控制连接在服务器端的当前目录
+    const char *filename; // 远程文件名
+    long long offset;     // 起始偏移
+    long long length;     // 范围长度
+    int ok;               // 是否下载成功
+};
+
+/**
+ * @brief 下载一个文件范围并用pwrite写到本地文件的对应位置
+ * @param arg 文件范围
+ */
+void *download_stripe(void *arg)
+{
+    struct stripe *st = (struct stripe *)arg;
+    char buffer[BUFFER_SIZE];
+    char data[TRANSFER_CHUNK];
+
+    // 跳过欢迎信息, 切换到与控制连接相同的目录后请求文件范围; 服务器连接数已满时应答421
+    if (recv_line(st->sockfd, buffer, BUFFER_SIZE) < 0 || strncmp(buffer, "421", 3) == 0)
+        return NULL;
+    snprintf(buffer, BUFFER_SIZE, "CD %s\r\n", st->cwd);
+    if (send_all(st->sockfd, buffer, strlen(buffer)) < 0 || recv_line(st->sockfd, buffer, BUFFER_SIZE) < 0)
+        return NULL;
+    snprintf(buffer, BUFFER_SIZE, "PART %lld %lld %s\r\n", st->offset, st->length, st->filename);
+    if (send_all(st->sockfd, buffer, strlen(buffer)) < 0)
+        return NULL;
+    long long size;
+    if (recv_line(st->sockfd, buffer, BUFFER_SIZE) < 0 || sscanf(buffer, "150 %lld", &size) != 1 || size != st->length)
+        return NULL;
+
+    long long pos = st->offset;
+    long long left = st->length;
+    while (left > 0)
+    {
+        int n = recv(st->sockfd, data, left < TRANSFER_CHUNK ? left : TRANSFER_CHUNK, 0);
+        if (n <= 0)
+            return NULL;
+        if (pwrite(st->fd, data, n, pos) != n)
+            return NULL;
+        pos += n;
+        left -= n;
+    }
+
+    if (recv_line(st->sockfd, buffer, BUFFER_SIZE) < 0 || strncmp(buffer, "226", 3) != 0)
+        return NULL;
+    send_all(st->sockfd, "QUIT\r\n", 6);
+    st->ok = 1;
+    return NULL;
+}
+
+/**
+ * @brief 通过多个连接并行下载服务器端文件, 每个连接下载不相交的一段
+ * @param sockfd 控制连接的套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param hostname 服务器主机名
+ * @param port 服务器端口号
+ * @param filename 文件名
+ * @param jobs 并行连接数
+ */
+void download_file_striped(int sockfd, char *buffer, const char *hostname, int port, const char *filename, int jobs)
+{
+    // 先通过控制连接获取当前目录和文件大小
+    char cwd[BUFFER_SIZE];
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "PWD\r\nSIZE %s\r\n", filename);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    long long size;
+    if (recv_line(sockfd, cwd, BUFFER_SIZE) < 0 || recv_line(sockfd, buffer, BUFFER_SIZE) < 0)
+        error("FTP server closed connection");
+    cwd[strcspn(cwd, "\r\n")] = '\0';
+    if (strncmp(buffer, "550", 3) == 0 || sscanf(buffer, "%lld bytes", &size) != 1)
+    {
+        printf("Failed to download file.\n");
+        return;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+        error("Error: cannot create local file");
+
+    // 小文件不值得拆成太多段
+    if (jobs > MAX_STRIPES)
+        jobs = MAX_STRIPES;
+    if (size < (long long)jobs * TRANSFER_CHUNK)
+        jobs = size / TRANSFER_CHUNK + 1;
+
+    // gethostbyname不可重入, 在主线程中建立全部连接
+    struct stripe stripes[MAX_STRIPES];
+    pthread_t threads[MAX_STRIPES];
+    long long part = size / jobs;
+    for (int i = 0; i < jobs; i++)
+    {
+        stripes[i].sockfd = connect_to_server(hostname, port);
+        stripes[i].fd = fd;
+        stripes[i].cwd = cwd;
+        stripes[i].filename = filename;
+        stripes[i].offset = part * i;
+        stripes[i].length = i == jobs - 1 ? size - part * i : part;
+        stripes[i].ok = 0;
+    }
+
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&threads[i], NULL, download_stripe, &stripes[i]) != 0)
+            error("Error: cannot create download thread");
+
+    int failed = 0;
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_join(threads[i], NULL);
+        close(stripes[i].sockfd);
+        if (!stripes[i].ok)
+            failed++;
+    }
+    close(fd);
+
+    if (failed > 0)
+        printf("Failed to download file: %d of %d ranges failed.\n", failed, jobs);
+    else
+        printf("File downloaded successfully over %d connections. %lld bytes received.\n", jobs, size);
+}
+
+/**
+ * @brief 批量传输中的一个文件
+ */
+struct batch_file
+{
+    char *name;        // 文件名
+    long long bytes;   // 传输的字节数
+    int state;         // 0尚未传输, 1成功, -1失败
+    char reason[128];  // 失败的原因
+};
+
+/**
+ * @brief 批量传输的共享工作队列, 连接池中的线程从中依次取出文件
+ */
+struct batch
+{
+    pthread_mutex_t lock;     // 保护下面的字段和输出
+    struct batch_file *files; // 待传输的文件
+    int count;                // 文件数
+    int next;                 // 下一个待取出的文件
+    int done;                 // 已经结束的文件数
+    int failed;               // 失败的文件数
+    long long bytes;          // 已传输的总字节数
+    int upload;               // 1为mput, 0为mget
+    const char *cwd;          // 控制连接在服务器端的当前目录
+};
+
+/**
+ * @brief 连接池中的一个连接
+ */
+struct pool_worker
+{
+    struct batch *b; // 共享的工作队列
+    int sockfd;      // 该线程使用的连接
+};
+
+/**
+ * @brief 在连接池的一个连接上下载一个文件
+ * @param sockfd 套接字文件描述符
+ * @param f 文件
+ * @return 成功返回1, 该文件失败返回0, 连接已不可用返回-1
+ */
+int batch_get(int sockfd, struct batch_file *f)
+{
+    char buffer[BUFFER_SIZE];
+    char data[TRANSFER_CHUNK];
+    snprintf(buffer, BUFFER_SIZE, "GET %s\r\n", f->name);
+    if (send_all(sockfd, buffer, strlen(buffer)) < 0 || recv_line(sockfd, buffer, BUFFER_SIZE) < 0)
+        return -1;
+    long long size;
+    if (sscanf(buffer, "150 %lld", &size) != 1)
+    {
+        snprintf(f->reason, sizeof(f->reason), "%.*s", (int)strcspn(buffer, "\r\n"), buffer);
+        return 0;
+    }
+
+    // 本地文件无法创建时仍然要读完数据, 连接才能继续使用
+    int fd = open(f->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        snprintf(f->reason, sizeof(f->reason), "cannot create local file");
+    long long pos = 0;
+    while (pos < size)
+    {
+        int n = recv(sockfd, data, size - pos < TRANSFER_CHUNK ? size - pos : TRANSFER_CHUNK, 0);
+        if (n <= 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            snprintf(f->reason, sizeof(f->reason), "connection lost");
+            return -1;
+        }
+        if (fd >= 0 && pwrite(fd, data, n, pos) != n)
+        {
+            close(fd);
+            fd = -1;
+            snprintf(f->reason, sizeof(f->reason), "cannot write local file");
+        }
+        pos += n;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (recv_line(sockfd, buffer, BUFFER_SIZE) < 0)
+        return -1;
+    f->bytes = size;
+    return f->reason[0] == '\0' && strncmp(buffer, "226", 3) == 0;
+}
+
+/**
+ * @brief 在连接池的一个连接上上传一个文件
+ * @param sockfd 套接字文件描述符
+ * @param f 文件
+ * @return 成功返回1, 该文件失败返回0, 连接已不可用返回-1
+ */
+int batch_put(int sockfd, struct batch_file *f)
+{
+    char buffer[BUFFER_SIZE];
+    char data[TRANSFER_CHUNK];
+    int fd = open(f->name, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        snprintf(f->reason, sizeof(f->reason), "cannot open local file");
+        return 0;
+    }
+
+    snprintf(buffer, BUFFER_SIZE, "PUT %lld %s\r\n", (long long)file_stat.st_size, f->name);
+    if (send_all(sockfd, buffer, strlen(buffer)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    long long pos = 0;
+    while (pos < file_stat.st_size)
+    {
+        // 已经声明了长度, 本地文件变短时连接无法继续使用
+        ssize_t n = pread(fd, data, file_stat.st_size - pos < TRANSFER_CHUNK ? file_stat.st_size - pos : TRANSFER_CHUNK, pos);
+        if (n <= 0 || send_all(sockfd, data, n) < 0)
+        {
+            close(fd);
+            snprintf(f->reason, sizeof(f->reason), n <= 0 ? "cannot read local file" : "connection lost");
+            return -1;
+        }
+        pos += n;
+    }
+    close(fd);
+
+    if (recv_line(sockfd, buffer, BUFFER_SIZE) < 0)
+        return -1;
+    f->bytes = pos;
+    if (strncmp(buffer, "226", 3) == 0)
+        return 1;
+    snprintf(f->reason, sizeof(f->reason), "%.*s", (int)strcspn(buffer, "\r\n"), buffer);
+    return 0;
+}
+
+/**
+ * @brief 连接池中的线程: 不断从工作队列中取出文件传输, 直到队列为空或连接断开
+ * @param arg 连接池中的连接
+ */
+void *batch_worker(void *arg)
+{
+    struct pool_worker *w = (struct pool_worker *)arg;
+    struct batch *b = w->b;
+    char buffer[BUFFER_SIZE];
+
+    // 跳过欢迎信息, 切换到与控制连接相同的目录; 服务器连接数已满时应答421
+    if (recv_line(w->sockfd, buffer, BUFFER_SIZE) < 0 || strncmp(buffer, "421", 3) == 0)
+        return NULL;
+    snprintf(buffer, BUFFER_SIZE, "CD %s\r\n", b->cwd);
+    if (send_all(w->sockfd, buffer, strlen(buffer)) < 0 || recv_line(w->sockfd, buffer, BUFFER_SIZE) < 0)
+        return NULL;
+
+    while (true)
+    {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next < b->count ? b->next++ : -1;
+        pthread_mutex_unlock(&b->lock);
+        if (i < 0)
+            break;
+
+        struct batch_file *f = &b->files[i];
+        int ret = b->upload ? batch_put(w->sockfd, f) : batch_get(w->sockfd, f);
+        if (ret < 0 && f->reason[0] == '\0')
+            snprintf(f->reason, sizeof(f->reason), "connection lost");
+
+        pthread_mutex_lock(&b->lock);
+        f->state = ret > 0 ? 1 : -1;
+        b->done++;
+        b->bytes += f->bytes;
+        if (ret <= 0)
+            b->failed++;
+        if (ret > 0)
+            printf("[%d/%d] %s: %lld bytes.\n", b->done, b->count, f->name, f->bytes);
+        else
+            printf("[%d/%d] %s: failed, %s.\n", b->done, b->count, f->name, f->reason);
+        fflush(stdout);
+        pthread_mutex_unlock(&b->lock);
+
+        // 连接断开后由其他线程继续处理队列中剩余的文件
+        if (ret < 0)
+            return NULL;
+    }
+    send_all(w->sockfd, "QUIT\r\n", 6);
+    return NULL;
+}
+
+/**
+ * @brief 把一个文件名加入批量传输的文件列表
+ * @param b 批量传输
+ * @param name 文件名
+ */
+void batch_add(struct batch *b, const char *name)
+{
+    if (b->count % 64 == 0)
+    {
+        b->files = (struct batch_file *)realloc(b->files, (b->count + 64) * sizeof(struct batch_file));
+        if (b->files == NULL)
+            error("Error: out of memory");
+    }
+    struct batch_file *f = &b->files[b->count++];
+    f->name = strdup(name);
+    f->bytes = 0;
+    f->state = 0;
+    f->reason[0] = '\0';
+}
+
+/**
+ * @brief 用服务器端的MLSD展开模式, 只保留普通文件
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param b 批量传输
+ * @param pattern 通配符模式
+ */
+void expand_remote_pattern(int sockfd, char *buffer, struct batch *b, const char *pattern)
+{
+    snprintf(buffer, BUFFER_SIZE, "MLSD %.1000s\r\n", pattern);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    while (true)
+    {
+        recv_reply(sockfd, buffer);
+        if (strncmp(buffer, "type=", 5) != 0)
+        {
+            if (strncmp(buffer, "END", 3) != 0)
+                printf("%s", buffer);
+            break;
+        }
+        // 事实列表和文件名之间用"; "分隔
+        char *name = strstr(buffer, "; ");
+        if (strncmp(buffer, "type=file;", 10) != 0 || name == NULL)
+            continue;
+        name += 2;
+        name[strcspn(name, "\r\n")] = '\0';
+        batch_add(b, name);
+    }
+}
+
+/**
+ * @brief 用本地的glob展开模式, 只保留普通文件
+ * @param b 批量传输
+ * @param pattern 通配符模式
+ */
+void expand_local_pattern(struct batch *b, const char *pattern)
+{
+    glob_t g;
+    if (glob(pattern, 0, NULL, &g) != 0)
+    {
+        printf("mput: no local files match '%s'\n", pattern);
+        return;
+    }
+    for (size_t i = 0; i < g.gl_pathc; i++)
+    {
+        struct stat file_stat;
+        if (stat(g.gl_pathv[i], &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+            batch_add(b, g.gl_pathv[i]);
+    }
+    globfree(&g);
+}
+
+/**
+ * @brief 批量下载或上传匹配的文件: 展开模式后通过多个连接并行传输, 每个连接从共享的队列中取文件
+ * @param sockfd 控制连接的套接字文件描述符
+ * @param buffer 缓冲区指针, 保存完整的命令行
+ * @param hostname 服务器主机名
+ * @param port 服务器端口号
+ * @param upload 1为mput, 0为mget
+ */
+void transfer_files_batch(int sockfd, char *buffer, const char *hostname, int port, int upload)
+{
+    // 解析 [-j n] <模式>...
+    char line[BUFFER_SIZE];
+    snprintf(line, sizeof(line), "%s", buffer);
+    int jobs = DEFAULT_POOL;
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+    b.upload = upload;
+    int patterns = 0;
+    char *save = NULL;
+    strtok_r(line, " ", &save);
+    for (char *tok = strtok_r(NULL, " ", &save); tok != NULL; tok = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(tok, "-j") == 0)
+        {
+            tok = strtok_r(NULL, " ", &save);
+            if (tok == NULL || (jobs = atoi(tok)) <= 0)
+                break;
+            continue;
+        }
+        if (upload)
+            expand_local_pattern(&b, tok);
+        else
+            expand_remote_pattern(sockfd, buffer, &b, tok);
+        patterns++;
+    }
+    if (patterns == 0 || jobs <= 0)
+    {
+        printf("Usage: %s [-j n] <pattern>...\n", upload ? "mput" : "mget");
+        return;
+    }
+    if (b.count == 0)
+    {
+        printf("No files to transfer.\n");
+        return;
+    }
+
+    // 连接池中的连接使用与控制连接相同的目录
+    char cwd[BUFFER_SIZE];
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "PWD\r\n");
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    if (recv_line(sockfd, cwd, BUFFER_SIZE) < 0)
+        error("FTP server closed connection");
+    cwd[strcspn(cwd, "\r\n")] = '\0';
+    b.cwd = cwd;
+
+    if (jobs > MAX_POOL)
+        jobs = MAX_POOL;
+    if (jobs > b.count)
+        jobs = b.count;
+    pthread_mutex_init(&b.lock, NULL);
+
+    // gethostbyname不可重入, 在主线程中建立全部连接
+    struct pool_worker workers[MAX_POOL];
+    pthread_t threads[MAX_POOL];
+    for (int i = 0; i < jobs; i++)
+    {
+        workers[i].b = &b;
+        workers[i].sockfd = connect_to_server(hostname, port);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&threads[i], NULL, batch_worker, &workers[i]) != 0)
+            error("Error: cannot create transfer thread");
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_join(threads[i], NULL);
+        close(workers[i].sockfd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_destroy(&b.lock);
+
+    // 所有连接都断开时队列中可能还有没有取出的文件
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int skipped = b.count - b.done;
+    printf("%d of %d files transferred, %lld bytes in %.2f s (%.1f MB/s) over %d connections.\n",
+           b.done - b.failed, b.count, b.bytes, seconds, seconds > 0 ? b.bytes / seconds / 1e6 : 0.0, jobs);
+    if (b.failed > 0 || skipped > 0)
+    {
+        printf("Failed:\n");
+        for (int i = 0; i < b.count; i++)
+            if (b.files[i].state != 1)
+                printf("  %s: %s\n", b.files[i].name, b.files[i].state < 0 ? b.files[i].reason : "not transferred");
+    }
+
+    for (int i = 0; i < b.count; i++)
+        free(b.files[i].name);
+    free(b.files);
+}
+
+/**
+ * @brief 获取远程文件的大小
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ * @return 文件大小, 文件不存在时返回0
+ */
+long long get_remote_file_size(int sockfd, char *buffer, const char *filename)
+{
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "SIZE %s\r\n", filename);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    recv_reply(sockfd, buffer);
+
+    long long size;
+    if (strncmp(buffer, "550", 3) == 0 || sscanf(buffer, "%lld bytes", &size) != 1)
+        return 0;
+    return size;
+}
+
+/**
+ * @brief 计算本地文件的CRC32C校验和
+ * @param filename 文件名
+ * @param crc 保存校验和
+ * @param size 保存文件大小
+ * @return 成功返回0, 文件无法读取返回-1
+ */
+int get_local_file_hash(const char *filename, uint32_t *crc, long long *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    static char data[FRAME_BLOCK];
+    uint32_t value = 0xFFFFFFFFu;
+    long long total = 0;
+    ssize_t n;
+    while ((n = read(fd, data, sizeof(data))) > 0)
+    {
+        value = crc32c_update(value, data, n);
+        total += n;
+    }
+    close(fd);
+    if (n < 0)
+        return -1;
+
+    *crc = ~value;
+    *size = total;
+    return 0;
+}
+
+/**
+ * @brief 获取远程文件的CRC32C校验和
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ * @param crc 保存校验和
+ * @param size 保存文件大小
+ * @return 成功返回0, 文件不存在或无法读取返回-1
+ */
+int get_remote_file_hash(int sockfd, char *buffer, const char *filename, uint32_t *crc, long long *size)
+{
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "HASH %s\r\n", filename);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    // 服务器要读完整个文件才应答, 大文件可能需要很长时间, 等待期间不设超时
+    struct timeval saved_timeout, no_timeout = {0, 0};
+    set_recv_timeout(sockfd, no_timeout, &saved_timeout);
+    recv_reply(sockfd, buffer);
+    set_recv_timeout(sockfd, saved_timeout, NULL);
+
+    unsigned int value;
+    if (sscanf(buffer, "213 crc32c=%x size=%lld", &value, size) != 2)
+        return -1;
+    *crc = value;
+    return 0;
+}
+
+/**
+ * @brief 比较本地文件和服务器上同名文件的校验和
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ */
+void verify_file(int sockfd, char *buffer, const char *filename)
+{
+    uint32_t local_crc, remote_crc;
+    long long local_size, remote_size;
+    if (get_local_file_hash(filename, &local_crc, &local_size) < 0)
+    {
+        printf("Failed to read local file.\n");
+        return;
+    }
+    if (get_remote_file_hash(sockfd, buffer, filename, &remote_crc, &remote_size) < 0)
+    {
+        printf("%s", buffer);
+        return;
+    }
+
+    printf("local:  crc32c=%08x size=%lld\n", local_crc, local_size);
+    printf("remote: crc32c=%08x size=%lld\n", remote_crc, remote_size);
+    if (local_crc == remote_crc && local_size == remote_size)
+        printf("Files match.\n");
+    else
+        printf("Files differ.\n");
+}
+
+/**
+ * @brief 服务器上没有相同的文件时才上传
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ */
+void upload_file_if_changed(int sockfd, char *buffer, const char *filename)
+{
+    uint32_t local_crc, remote_crc;
+    long long local_size, remote_size;
+    if (get_local_file_hash(filename, &local_crc, &local_size) == 0 &&
+        get_remote_file_hash(sockfd, buffer, filename, &remote_crc, &remote_size) == 0 &&
+        local_crc == remote_crc && local_size == remote_size)
+    {
+        printf("Skipped %s: the server already has an identical copy (crc32c=%08x).\n", filename, local_crc);
+        return;
+    }
+    upload_file(sockfd, buffer, filename, 0);
+}
+
+/**
+ * @brief 服务器文件中一个完整块的校验和
+ */
+struct block_sum
+{
+    uint32_t weak;   // 滚动弱校验和
+    uint32_t strong; // CRC32C
+    uint32_t index;  // 块号
+};
+
+/**
+ * @brief 按弱校验和排序, 相同时按块号排序
+ */
+int compare_block_sums(const void *a, const void *b)
+{
+    const struct block_sum *x = (const struct block_sum *)a;
+    const struct block_sum *y = (const struct block_sum *)b;
+    if (x->weak != y->weak)
+        return x->weak < y->weak ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index ? 1 : 0);
+}
+
+/**
+ * @brief 弱校验和的16位标记, 用于快速排除不可能匹配的位置
+ */
+static inline uint32_t weak_tag(uint32_t weak)
+{
+    return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+/**
+ * @brief 增量上传的发送缓冲区, 块引用只有4个字节, 攒满后一次发送
+ */
+struct delta_output
+{
+    int sockfd;                 // 套接字文件描述符
+    char data[TRANSFER_CHUNK];  // 待发送的数据
+    size_t len;                 // 缓冲区中的字节数
+    long long literal;          // 已发送的字面数据字节数
+    long long copied;           // 引用的块数
+};
+
+/**
+ * @brief 发送增量数据, 小块数据先放入缓冲区
+ * @param out 发送缓冲区
+ * @param data 数据指针
+ * @param n 数据长度
+ */
+void delta_put(struct delta_output *out, const void *data, size_t n)
+{
+    if (out->len + n > sizeof(out->data))
+    {
+        if (send_all(out->sockfd, out->data, out->len) < 0)
+            error("Error sending file to server");
+        out->len = 0;
+    }
+    if (n >= sizeof(out->data))
+    {
+        if (send_all(out->sockfd, (const char *)data, n) < 0)
+            error("Error sending file to server");
+        return;
+    }
+    memcpy(out->data + out->len, data, n);
+    out->len += n;
+}
+
+/**
+ * @brief 以数据块的形式发送一段字面数据
+ * @param out 发送缓冲区
+ * @param data 数据指针
+ * @param n 数据长度
+ */
+void delta_literal(struct delta_output *out, const char *data, size_t n)
+{
+    while (n > 0)
+    {
+        uint32_t len = n < TRANSFER_CHUNK ? n : TRANSFER_CHUNK;
+        uint32_t header = htonl(len);
+        delta_put(out, &header, sizeof(header));
+        delta_put(out, data, len);
+        out->literal += len;
+        data += len;
+        n -= len;
+    }
+}
+
+/**
+ * @brief 在服务器的分块校验和中查找与一段数据相同的块
+ * @param sums 按弱校验和排序的分块校验和
+ * @param count 块数
+ * @param weak 这段数据的弱校验和
+ * @param data 数据指针
+ * @param n 数据长度
+ * @param expect 优先选择的块号
+ * @return 块号, 没有相同的块时返回-1
+ */
+long long find_block(const struct block_sum *sums, long long count, uint32_t weak, const char *data, size_t n, long long expect)
+{
+    long long lo = 0, hi = count;
+    while (lo < hi)
+    {
+        long long mid = (lo + hi) / 2;
+        if (sums[mid].weak < weak)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == count || sums[lo].weak != weak)
+        return -1;
+
+    // 弱校验和相同时才计算强校验和, 同一内容出现多次时优先选择原位置的块
+    uint32_t strong = ~crc32c_update(0xFFFFFFFFu, data, n);
+    long long found = -1;
+    for (long long i = lo; i < count && sums[i].weak == weak; i++)
+    {
+        if (sums[i].strong != strong)
+            continue;
+        if (found < 0 || sums[i].index == expect)
+            found = sums[i].index;
+        if (found == expect)
+            break;
+    }
+    return found;
+}
+
+/**
+ * @brief 增量更新服务器上的文件: 获取服务器文件的分块校验和, 用滚动校验和在本地文件中查找相同的块,
+ *        只发送块引用和不同的数据, 服务器据此重建文件
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ */
+void send_file_delta(int sockfd, char *buffer, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0)
+    {
+        printf("put: cannot open '%s': No such file or directory\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    long long size = file_stat.st_size;
+
+    // 块大小约为文件长度的平方根, 兼顾校验和的数量和匹配的粒度
+    long long blocksize = DELTA_MIN_BLOCK;
+    while (blocksize < DELTA_MAX_BLOCK && blocksize * blocksize < size)
+        blocksize *= 2;
+    if (size < blocksize)
+    {
+        close(fd);
+        upload_file(sockfd, buffer, filename, 0);
+        return;
+    }
+
+    // 获取服务器文件的分块校验和, 服务器上没有该文件时上传整个文件
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "SUMS %lld %s\r\n", blocksize, filename);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    recv_reply(sockfd, buffer);
+    long long count;
+    if (sscanf(buffer, "150 %lld blocks", &count) != 1)
+    {
+        printf("No remote copy to update, uploading the whole file.\n");
+        close(fd);
+        upload_file(sockfd, buffer, filename, 0);
+        return;
+    }
+
+    uint32_t *raw = (uint32_t *)malloc(count * 8 + 1);
+    struct block_sum *sums = (struct block_sum *)malloc(count * sizeof(struct block_sum) + 1);
+    unsigned char *tags = (unsigned char *)calloc(65536 / 8, 1);
+    if (raw == NULL || sums == NULL || tags == NULL)
+        error("Error: out of memory");
+    if (recv_all(sockfd, (char *)raw, count * 8) < 0 || recv_line(sockfd, buffer, BUFFER_SIZE) < 0)
+        error("FTP server closed connection");
+    for (long long i = 0; i < count; i++)
+    {
+        sums[i].weak = ntohl(raw[2 * i]);
+        sums[i].strong = ntohl(raw[2 * i + 1]);
+        sums[i].index = i;
+        tags[weak_tag(sums[i].weak) >> 3] |= 1 << (weak_tag(sums[i].weak) & 7);
+    }
+    free(raw);
+    qsort(sums, count, sizeof(struct block_sum), compare_block_sums);
+
+    const char *p = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        error("Error: cannot read local file");
+    madvise((void *)p, size, MADV_SEQUENTIAL);
+
+    memset(buffer, 0, BUFFER_SIZE);
+    sprintf(buffer, "DELTA %lld %lld %s\r\n", size, blocksize, filename);
+    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+
+    // a是窗口内字节的和, b是按位置加权的和, 窗口每向后移动一个字节都可以O(1)更新
+    static struct delta_output out;
+    out.sockfd = sockfd;
+    out.len = 0;
+    out.literal = 0;
+    out.copied = 0;
+    const unsigned char *u = (const unsigned char *)p;
+    long long pos = 0, literal = 0;
+    uint32_t a = 0, b = 0;
+    bool rolling = false;
+    while (pos + blocksize <= size)
+    {
+        if (!rolling)
+        {
+            a = b = 0;
+            for (long long i = 0; i < blocksize; i++)
+            {
+                a += u[pos + i];
+                b += (uint32_t)(blocksize - i) * u[pos + i];
+            }
+            rolling = true;
+        }
+
+        uint32_t weak = (a & 0xffff) | (b << 16);
+        long long index = -1;
+        if (tags[weak_tag(weak) >> 3] & (1 << (weak_tag(weak) & 7)))
+            index = find_block(sums, count, weak, p + pos, blocksize, pos / blocksize);
+        if (index >= 0)
+        {
+            delta_literal(&out, p + literal, pos - literal);
+            uint32_t header = htonl(FRAME_COPY | (uint32_t)index);
+            delta_put(&out, &header, sizeof(header));
+            out.copied++;
+            pos += blocksize;
+            literal = pos;
+            rolling = false;
+            continue;
+        }
+
+        if (pos + blocksize < size)
+        {
+            a = a - u[pos] + u[pos + blocksize];
+            b = b - (uint32_t)blocksize * u[pos] + a;
+        }
+        pos++;
+    }
+    delta_literal(&out, p + literal, size - literal);
+    uint32_t end = 0;
+    delta_put(&out, &end, sizeof(end));
+    if (send_all(sockfd, out.data, out.len) < 0)
+        error("Error sending file to server");
+
+    uint32_t crc = ~crc32c_update(0xFFFFFFFFu, p, size);
+    munmap((void *)p, size);
+    free(sums);
+    free(tags);
+
+    printf("Sent %lld literal bytes and %lld block references (%.1f%% of %lld bytes).\n",
+           out.literal, out.copied, size > 0 ? 100.0 * out.literal / size : 0.0, size);
+    recv_reply(sockfd, buffer);
+    if (strncmp(buffer, "226", 3) != 0)
+    {
+        printf("Failed to upload file.\n");
+        return;
+    }
+
+    // 弱校验和与强校验和都相同的不同块极少出现, 但仍然用整个文件的校验和确认结果
+    uint32_t remote_crc;
+    long long remote_size;
+    if (get_remote_file_hash(sockfd, buffer, filename, &remote_crc, &remote_size) == 0 && remote_crc == crc && remote_size == size)
+    {
+        printf("File updated successfully.\n");
+        return;
+    }
+    printf("Checksum mismatch after delta update, uploading the whole file.\n");
+    upload_file(sockfd, buffer, filename, 0);
+}
+
+/**
+ * @brief 增量上传文件. 服务器计算分块校验和、重建文件和计算整个文件的校验和都要读完整个文件,
+ *        大文件的应答可能需要很长时间, 整个过程中不设接收超时, 结束后恢复原来的超时
+ * @param sockfd 套接字文件描述符
+ * @param buffer 缓冲区指针
+ * @param filename 文件名
+ */
+void upload_file_delta(int sockfd, char *buffer, const char *filename)
+{
+    struct timeval saved_timeout, no_timeout = {0, 0};
+    set_recv_timeout(sockfd, no_timeout, &saved_timeout);
+    send_file_delta(sockfd, buffer, filename);
+    set_recv_timeout(sockfd, saved_timeout, NULL);
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 3)
@@ -430,6 +2064,7 @@ int main(int argc, char *argv[])
 
     char *hostname = argv[1];
     int port = atoi(argv[2]);
+    crc32c_init();
 
     int sockfd = connect_to_server(hostname, port);
 
@@ -438,6 +2073,12 @@ int main(int argc, char *argv[])
     memset(buffer, 0, BUFFER_SIZE);
     recv(sockfd, buffer, BUFFER_SIZE, 0);
     printf("%s", buffer);
+    // 服务器连接数已满时应答421后关闭连接
+    if (strncmp(buffer, "421", 3) == 0)
+    {
+        close(sockfd);
+        return 1;
+    }
 
     // 循环处理命令
     while (true)
@@ -463,13 +2104,56 @@ int main(int argc, char *argv[])
         sscanf(buffer, "%s %s", cmd, arg);
 
         // 处理命令
-        if (strcmp(cmd, "get") == 0 && strlen(arg) > 0)
+        int jobs;
+        if (strcmp(cmd, "get") == 0 && strcmp(arg, "-j") == 0)
         {
-            download_file(sockfd, buffer, arg);
+            if (sscanf(buffer, "%*s -j %d %s", &jobs, arg) == 2 && jobs > 0)
+                download_file_striped(sockfd, buffer, hostname, port, arg, jobs);
+            else
+                printf("Usage: get -j <n> <file>\n");
+        }
+        else if (strcmp(cmd, "get") == 0 && strlen(arg) > 0)
+        {
+            download_file(sockfd, buffer, arg, 0);
+        }
+        else if (strcmp(cmd, "reget") == 0 && strlen(arg) > 0)
+        {
+            // 本地已有的长度就是续传的起始偏移
+            struct stat file_stat;
+            download_file(sockfd, buffer, arg, stat(arg, &file_stat) == 0 ? file_stat.st_size : 0);
+        }
+        else if (strcmp(cmd, "put") == 0 && strcmp(arg, "-s") == 0)
+        {
+            if (sscanf(buffer, "%*s -s %s", arg) == 1)
+                upload_file_if_changed(sockfd, buffer, arg);
+            else
+                printf("Usage: put -s <file>\n");
+        }
+        else if (strcmp(cmd, "put") == 0 && strcmp(arg, "-d") == 0)
+        {
+            if (sscanf(buffer, "%*s -d %s", arg) == 1)
+                upload_file_delta(sockfd, buffer, arg);
+            else
+                printf("Usage: put -d <file>\n");
         }
         else if (strcmp(cmd, "put") == 0 && strlen(arg) > 0)
         {
-            upload_file(sockfd, buffer, arg);
+            upload_file(sockfd, buffer, arg, 0);
+        }
+        else if (strcmp(cmd, "reput") == 0 && strlen(arg) > 0)
+        {
+            // 服务器端已有的长度就是续传的起始偏移
+            upload_file(sockfd, buffer, arg, get_remote_file_size(sockfd, buffer, arg));
+        }
+        else if (strcmp(cmd, "mget") == 0 || strcmp(cmd, "mput") == 0)
+        {
+            transfer_files_batch(sockfd, buffer, hostname, port, strcmp(cmd, "mput") == 0);
+        }
+        else if (strcmp(cmd, "mode") == 0 && strlen(arg) > 0)
+        {
+            int level = 0;
+            sscanf(buffer, "%*s %*s %d", &level);
+            set_transfer_mode(sockfd, buffer, arg, level);
         }
         else if (strcmp(cmd, "pwd") == 0)
         {
@@ -483,6 +2167,12 @@ int main(int argc, char *argv[])
         {
             show_remote_directory_info(sockfd, buffer);
         }
+        else if (strcmp(cmd, "mls") == 0)
+        {
+            // 参数可以有多个, 把命令之后的整行都交给服务器
+            const char *args = buffer + strspn(buffer, " ") + strlen(cmd);
+            show_remote_machine_list(sockfd, buffer, args + strspn(args, " "));
+        }
         else if (strcmp(cmd, "!dir") == 0)
         {
             show_local_directory_info();
@@ -495,6 +2185,10 @@ int main(int argc, char *argv[])
         {
             change_local_directory(arg);
         }
+        else if (strcmp(cmd, "verify") == 0 && strlen(arg) > 0)
+        {
+            verify_file(sockfd, buffer, arg);
+        }
         else if (strcmp(cmd, "size") == 0)
         {
             show_remote_file_size(sockfd, buffer, arg);
@@ -503,6 +2197,10 @@ int main(int argc, char *argv[])
         {
             show_remote_system_type(sockfd, buffer);
         }
+        else if (strcmp(cmd, "stat") == 0)
+        {
+            show_remote_status(sockfd, buffer);
+        }
         else if (strcmp(cmd, "quit") == 0)
         {
             quit(sockfd, buffer);
@@ -1,413 +1,3922 @@
-#include <fstream>
+#include <string>
+#include <map>
+#include <list>
+#include <memory>
+#include <vector>
+#include <algorithm>
 #include <string.h>
+#include <ctype.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <zlib.h>
+#include <fnmatch.h>
 #include <pwd.h>
 #include <grp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+#define BUFFER_SIZE 1024
+#define LISTEN_BACKLOG SOMAXCONN
+#define MAX_EVENTS 256
+#define MAX_PENDING_OUTPUT (64 * 1024)
+#define TRANSFER_CHUNK (256 * 1024)
+#define TRANSFER_BUDGET (4 * TRANSFER_CHUNK)
+#define LIST_CHUNK (64 * 1024)
+#define DEFAULT_CACHE_MB 64
+#define WRITE_BEHIND_CHUNK (8 * 1024 * 1024)
+#define WRITEBACK_QUEUE 256
+// 数据块头部只有最高位一个标志位: MODE Z中表示数据未压缩, 增量上传中表示引用原有文件的一块, 其余位是长度或块号
+#define FRAME_FLAG 0x80000000u
+#define FRAME_STORED FRAME_FLAG
+#define FRAME_COPY FRAME_FLAG
+#define INCOMPRESSIBLE_LIMIT 2
+#define HASH_BUDGET (16 * TRANSFER_CHUNK)
+#define HASH_CACHE_MAX 4096
+#define INPUT_BUFFER (16 * BUFFER_SIZE)
+#define COMMAND_BITS 6
+#define COMMAND_SLOTS (1 << COMMAND_BITS)
+#define MIN_DELTA_BLOCK 512
+#define MAX_COMMANDS 32
+#define STAT_BUCKETS 24
+#define METRICS_REQUEST 4096
+#define LOG_RING_SLOTS 1024
+#define LOG_MESSAGE 232
+#define LOG_FLUSH_INTERVAL_MS 50
+#define SHAPER_TICK_MS 5
+#define SHAPER_BURST_MS 100
+#define SHAPER_QUANTUM (64 * 1024)
+#define SHAPER_MIN_GRANT (4 * 1024)
+#define SHAPER_SMALL (256 * 1024)
+#define DEFAULT_TRANSFER_QUEUE 64
+#define FDS_PER_SESSION 6
+#define RESERVED_FDS 64
+#define OUT_OF_RESOURCES "421 Server out of resources, try again later.\r\n"
+#define WHEEL_TICK_MS 1000
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_COMMAND_TIMEOUT 60
+#define DEFAULT_TRANSFER_TIMEOUT 60
+#define DIR_CACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * @brief 日志级别, 低于阈值的日志在调用处直接丢弃
+ */
+enum log_level
+{
+    LOG_DEBUG, // 每条命令
+    LOG_INFO,  // 连接和传输
+    LOG_WARN,  // 可以恢复的异常
+    LOG_ERROR  // 操作失败
+};
+
+/**
+ * @brief 环形缓冲区中的一条日志, 消息在调用处格式化, 时间和级别由后台线程格式化
+ */
+struct log_record
+{
+    struct timespec time;   // 记录的时刻
+    int level;              // 日志级别
+    char text[LOG_MESSAGE]; // 消息, 过长时截断
+};
+
+/**
+ * @brief 一个线程的日志环形缓冲区. 只有所属线程写入记录和head,
+ *        只有持有log_lock的后台线程读取记录和写入tail, 所以记录日志不需要加锁
+ */
+struct log_ring
+{
+    int id;                                    // 线程编号, 按第一次记录日志的顺序分配
+    uint64_t head;                             // 下一条记录的位置
+    uint64_t tail;                             // 后台线程已经输出到的位置
+    uint64_t dropped;                          // 缓冲区满时丢弃的日志数
+    uint64_t reported;                         // 已经报告过的丢弃数
+    struct log_record records[LOG_RING_SLOTS]; // 记录
+    struct log_ring *next;                     // 所有缓冲区组成的链表
+};
+
+static int log_threshold = LOG_INFO;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // 保护缓冲区链表和输出
+static struct log_ring *log_rings;
+static int log_ring_count;
+static __thread struct log_ring *thread_log_ring;
+
+/**
+ * @brief 为当前线程创建日志缓冲区
+ * @return 缓冲区
+ */
+struct log_ring *log_register()
+{
+    struct log_ring *ring = new log_ring();
+    pthread_mutex_lock(&log_lock);
+    ring->id = log_ring_count++;
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_lock);
+    return ring;
+}
+
+/**
+ * @brief 记录一条日志: 只格式化消息并放入本线程的环形缓冲区, 不加锁, 不进行系统调用.
+ *        缓冲区满时丢弃这条日志而不是等待
+ * @param level 日志级别
+ * @param fmt 格式字符串
+ */
+__attribute__((format(printf, 2, 3))) void log_message(int level, const char *fmt, ...)
+{
+    if (level < log_threshold)
+        return;
+    struct log_ring *ring = thread_log_ring;
+    if (ring == NULL)
+        ring = thread_log_ring = log_register();
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct log_record *r = &ring->records[head % LOG_RING_SLOTS];
+    clock_gettime(CLOCK_REALTIME, &r->time);
+    r->level = level;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(r->text, sizeof(r->text), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 输出所有缓冲区中的日志, 调用者必须持有log_lock.
+ *        信息写入stdout, 警告和错误写入stderr, 每轮只刷新一次
+ */
+void log_drain()
+{
+    static const char *names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    static time_t last_sec = -1;
+    static char stamp[32];
+    for (struct log_ring *ring = log_rings; ring != NULL; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t tail = ring->tail; tail != head; tail++)
+        {
+            const struct log_record *r = &ring->records[tail % LOG_RING_SLOTS];
+            // 同一秒内的日志复用格式化好的时间
+            if (r->time.tv_sec != last_sec)
+            {
+                struct tm tm;
+                localtime_r(&r->time.tv_sec, &tm);
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+                last_sec = r->time.tv_sec;
+            }
+            fprintf(r->level >= LOG_WARN ? stderr : stdout, "%s.%03ld %-5s [%d] %s\n", stamp, r->time.tv_nsec / 1000000,
+                    names[r->level], ring->id, r->text);
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported)
+        {
+            fprintf(stderr, "%s WARN  [%d] %llu log messages dropped\n", stamp, ring->id, (unsigned long long)(dropped - ring->reported));
+            ring->reported = dropped;
+        }
+    }
+    fflush(stdout);
+    fflush(stderr);
+}
+
+/**
+ * @brief 立即输出所有缓冲区中的日志
+ */
+void log_flush()
+{
+    pthread_mutex_lock(&log_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * @brief 日志线程: 定期输出各线程缓冲区中的日志
+ * @param arg 未使用
+ */
+void *log_main(void *arg)
+{
+    while (true)
+    {
+        log_flush();
+        usleep(LOG_FLUSH_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+/**
+ * @brief 输出错误信息并退出程序
+ * @param msg 错误信息
+ */
+void error(const char *msg)
+{
+    int saved = errno;
+    log_flush();
+    errno = saved;
+    perror(msg);
+    exit(1);
+}
+
+/**
+ * @brief 会话状态, 每个会话都是由读写就绪事件驱动的状态机
+ */
+enum session_state
+{
+    STATE_COMMAND,   // 等待并处理命令
+    STATE_SEND_FILE, // 正在发送文件 (GET)
+    STATE_SEND_LIST, // 正在发送目录列表 (DIR)
+    STATE_SEND_MLSD, // 正在扫描并发送机器可读的目录列表 (MLSD)
+    STATE_HASH,      // 正在计算文件的校验和 (HASH)
+    STATE_SEND_SUMS, // 正在发送文件的分块校验和 (SUMS)
+    STATE_RECV_FILE, // 正在接收文件 (PUT)
+    STATE_QUEUED,    // 传输名额已满, 在队列中等待, 暂停读取命令
+    STATE_CLOSING    // 发送完剩余数据后关闭连接
+};
+
+/**
+ * @brief GET/PUT使用的传输方式, 不支持的方式会自动降级到下一种
+ */
+enum transfer_mode
+{
+    MODE_SENDFILE, // sendfile直接从页缓存发送到套接字 (仅GET)
+    MODE_SPLICE,   // splice经过管道转发, 不经过用户空间
+    MODE_BUFFERED, // 经过用户空间缓冲区读写
+    MODE_DEFLATE,  // MODE Z: 按数据块压缩后传输
+    MODE_DELTA     // DELTA: 用原有文件中的块和字面数据重建文件 (仅PUT)
+};
+
+struct event_loop;
+struct command_entry;
+struct list_query;
+
+/**
+ * @brief 令牌桶, 令牌以字节计, 按速率连续补充, 最多积累burst个
+ */
+struct token_bucket
+{
+    double rate;   // 每秒补充的令牌数, 为0表示不限速
+    double burst;  // 最多积累的令牌数
+    double tokens; // 当前的令牌数, 小传输可以透支成负数
+    uint64_t last; // 上次补充的时刻, 单位纳秒
+};
+
+/**
+ * @brief 时间轮中的一个定时器, 链入到期刻度所在的槽
+ */
+struct wheel_timer
+{
+    struct wheel_timer *prev; // 槽中的前一个定时器, 不在时间轮中时为NULL
+    struct wheel_timer *next; // 槽中的后一个定时器
+    uint64_t expires;         // 到期的刻度, 单位WHEEL_TICK_MS毫秒
+    void *data;               // 定时器所属的对象
+};
+
+/**
+ * @brief 分层时间轮: 每层WHEEL_SLOTS个槽, 第0层每个槽一个刻度, 上一层的每个槽覆盖下一层的一整圈.
+ *        添加和删除定时器都是O(1), 上层的槽在下层转完一圈时整槽移到下层
+ */
+struct timer_wheel
+{
+    uint64_t now;                                        // 当前刻度
+    size_t count;                                        // 时间轮中的定时器数
+    struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // 每个槽的循环链表头
+};
+
+/**
+ * @brief 同一客户端IP的所有会话共享的状态: 令牌桶和连接数, 最后一个会话关闭时删除
+ */
+struct ip_bucket
+{
+    struct token_bucket bucket; // 令牌桶
+    int sessions;               // 该IP的会话数
+};
+
+/**
+ * @brief 客户端会话, 保存一个连接的全部状态
+ */
+struct session
+{
+    struct event_loop *loop;              // 所属的事件循环
+    int sockfd;                           // 套接字描述符
+    struct sockaddr_in client_addr;       // 客户端地址
+    char client_ip[INET_ADDRSTRLEN];      // 客户端IP地址字符串
+    enum session_state state;             // 当前状态
+    uint32_t events;                      // 当前在epoll中注册的事件
+    char inbuf[INPUT_BUFFER];             // 命令输入缓冲区, 可以容纳多条流水线发送的命令
+    size_t inpos;                         // 输入缓冲区中已经处理的位置
+    size_t inlen;                         // 输入缓冲区中数据的结束位置
+    size_t inscan;                        // 已经查找过换行符的位置
+    bool discard;                         // 正在丢弃超长的命令行
+    std::string outbuf;                   // 等待发送的数据
+    size_t outpos;                        // outbuf中已经发送的字节数
+    int filefd;                           // 正在传输的文件描述符
+    off_t filestart;                      // 本次传输在文件中的起始偏移
+    off_t filepos;                        // 当前传输到的文件偏移
+    off_t filesize;                       // 本次传输的结束偏移
+    enum transfer_mode mode;              // 本次传输使用的方式
+    int status;                           // PUT结束时的应答码
+    off_t restart;                        // REST设置的下一次传输的起始偏移
+    off_t synced;                         // PUT中已经提交回写的文件偏移
+    int zlevel;                           // MODE Z的压缩级别, 0表示不压缩
+    int zstored;                          // 连续无法压缩的数据块数
+    std::string zbuf;                     // 压缩模式下正在接收的数据块
+    uint32_t crc;                         // HASH正在计算的CRC32C
+    struct stat hashstat;                 // HASH文件的状态, 作为校验和缓存的键
+    int basefd;                           // DELTA引用的原有文件, 未使用时为-1
+    off_t blocksize;                      // SUMS/DELTA的块大小
+    std::string target;                   // DELTA完成后被替换的文件名
+    int pipefd[2];                        // splice使用的管道, 未创建时为-1
+    size_t pipelen;                       // 管道中尚未发出的字节数
+    int dirfd;                            // 会话的当前工作目录描述符
+    char *dents;                          // DIR使用的getdents64缓冲区
+    size_t dentlen;                       // 缓冲区中目录项的字节数
+    size_t dentpos;                       // 缓冲区中已经输出的字节数
+    int dirwd;                            // 当前目录在目录缓存中的inotify监视描述符, 未知时为-1
+    std::shared_ptr<std::string> listing; // 命中缓存时正在发送的DIR列表
+    size_t listpos;                       // listing中已经输出的字节数
+    std::shared_ptr<std::string> capture; // 生成DIR列表时同时保存的副本, 完成后放入缓存
+    unsigned long capture_gen;            // 开始生成列表时缓存项的版本
+    struct list_query *query;             // 正在生成的MLSD列表, 未使用时为NULL
+    int command;                          // 正在执行的命令在命令表中的下标, 已经完成时为-1
+    struct timespec command_start;        // 正在执行的命令开始的时刻
+    struct timespec connected;            // 连接建立的时刻
+    unsigned long commands_done;          // 本会话执行过的命令数
+    unsigned long long bytes_sent;        // 本会话发送的字节数
+    unsigned long long bytes_received;    // 本会话接收的字节数
+    struct token_bucket bucket;           // 本会话的限速令牌桶
+    struct ip_bucket *ip;                 // 客户端IP共享的令牌桶, 不限速时为NULL
+    bool throttled;                       // 正在等待令牌, 暂停传输
+    std::list<struct session *>::iterator throttle_pos; // 在等待令牌的队列中的位置
+    bool has_slot;                        // 占用了一个传输名额
+    bool refused;                         // 传输队列已满, 本次传输应答450
+    const struct command_entry *queued_cmd; // 排队等待的传输命令
+    std::string queued_arg;               // 排队等待的传输命令的参数
+    std::list<struct session *>::iterator queue_pos; // 在传输队列中的位置
+    uint64_t active;                      // 最后一次收发数据的刻度
+    struct wheel_timer deadline;          // 检查空闲、命令和传输超时的定时器
+};
+
+/**
+ * @brief MLSD列表中的一个目录项
+ */
+struct list_entry
+{
+    std::string name; // 文件名
+    char type;        // 'f'普通文件, 'd'目录, 'o'其他
+    off_t size;       // 文件大小
+    time_t mtime;     // 修改时间
+    mode_t mode;      // 权限位
+};
+
+/**
+ * @brief MLSD的排序方式, 排序键相同时按文件名排序, 保证顺序稳定
+ */
+struct list_order
+{
+    char key;  // 'n'按文件名, 's'按大小, 'm'按修改时间
+    bool desc; // 是否降序
+
+    bool operator()(const list_entry &a, const list_entry &b) const
+    {
+        if (key == 's' && a.size != b.size)
+            return desc ? a.size > b.size : a.size < b.size;
+        if (key == 'm' && a.mtime != b.mtime)
+            return desc ? a.mtime > b.mtime : a.mtime < b.mtime;
+        if (key == 'n' && desc)
+            return a.name > b.name;
+        return a.name < b.name;
+    }
+};
+
+/**
+ * @brief 与list_order相反的顺序, 用于按顺序逐个弹出目录项的小顶堆
+ */
+struct list_order_reverse
+{
+    list_order order; // 原来的排序方式
+
+    bool operator()(const list_entry &a, const list_entry &b) const
+    {
+        return order(b, a);
+    }
+};
+
+/**
+ * @brief 正在生成的MLSD列表: 目录在套接字可写时分批扫描, 扫描完成后再按发送缓冲区的余量分批输出
+ */
+struct list_query
+{
+    char pattern[BUFFER_SIZE];    // 文件名通配符
+    list_order order;             // 排序方式
+    size_t limit;                 // 每页的项数, 为0表示不分页
+    bool has_cursor;              // 是否只返回游标之后的目录项
+    list_entry after;             // 游标对应的目录项, 输出时改为记录最后输出的项
+    std::vector<list_entry> page; // 分页扫描时是淘汰靠后项的大顶堆, 输出时是逐个弹出最靠前项的小顶堆
+    bool scanned;                 // 目录已经扫描完成
+    bool more;                    // 本页之后还有更多目录项
+};
+
+/**
+ * @brief 目录缓存项, 保存一个目录格式化好的DIR列表和SIZE查询结果,
+ *        目录发生任何变化时由inotify事件使其失效
+ */
+struct dir_cache_entry
+{
+    int wd;                               // inotify监视描述符, 同时作为缓存的键
+    unsigned long generation;             // 每次失效加1, 用于丢弃生成期间目录已经变化的列表
+    std::shared_ptr<std::string> listing; // 格式化好的DIR列表, 不是普通文件的行只保存名字; 为空表示未缓存
+    std::map<std::string, off_t> sizes;   // SIZE查询结果, -1表示不是普通文件或不存在
+    size_t bytes;                         // 占用的内存
+    std::list<int>::iterator lru;         // 在LRU链表中的位置
+};
+
+/**
+ * @brief 校验和缓存的键, 文件内容变化时大小、修改时间或状态改变时间至少有一个会变
+ */
+struct hash_key
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    long long mtime_ns;
+    long long ctime_ns;
+
+    bool operator<(const hash_key &o) const
+    {
+        if (dev != o.dev)
+            return dev < o.dev;
+        if (ino != o.ino)
+            return ino < o.ino;
+        if (size != o.size)
+            return size < o.size;
+        if (mtime_ns != o.mtime_ns)
+            return mtime_ns < o.mtime_ns;
+        return ctime_ns < o.ctime_ns;
+    }
+};
+
+/**
+ * @brief 一种命令的执行次数和延迟直方图. 第i个桶统计延迟小于2^i微秒、
+ *        不小于2^(i-1)微秒的命令, 最后一个桶统计所有更慢的命令
+ */
+struct command_stats
+{
+    uint64_t count;                 // 完成的次数
+    uint64_t total_us;              // 延迟之和, 单位微秒
+    uint64_t buckets[STAT_BUCKETS]; // 延迟直方图
+};
+
+/**
+ * @brief 一个工作线程的统计计数. 只有所属线程写入, 其他线程只读,
+ *        所以计数不需要加锁, 也不需要原子的读-改-写指令
+ */
+struct loop_stats
+{
+    uint64_t sessions_opened;                    // 接受的连接数
+    uint64_t sessions_closed;                    // 关闭的连接数
+    uint64_t bytes_sent;                         // 发送的字节数
+    uint64_t bytes_received;                     // 接收的字节数
+    uint64_t invalid_commands;                   // 无法识别的命令数
+    uint64_t sessions_refused;                   // 超过会话上限被拒绝的连接数
+    uint64_t transfers_queued;                   // 因为传输名额已满而排队的传输数
+    uint64_t transfers_refused;                  // 因为队列已满而拒绝的传输数
+    uint64_t sessions_timed_out;                 // 因为超时而关闭的会话数
+    struct command_stats commands[MAX_COMMANDS]; // 按命令表下标统计的延迟
+};
+
+/**
+ * @brief 事件循环, 每个工作线程拥有一个epoll实例和一个SO_REUSEPORT监听套接字,
+ *        接受的会话从建立到关闭都只在该线程中处理
+ */
+struct event_loop
+{
+    int id;            // 工作线程编号
+    int cpu;           // 绑定的CPU编号, -1表示不绑定
+    int port;          // 监听端口号
+    bool write_behind; // PUT是否边写边回写并丢弃页缓存
+    int epfd;          // epoll描述符
+    int listenfd;      // 监听套接字描述符
+    pthread_t thread;  // 工作线程
+
+    // 用户和组名称的缓存, 只在本线程中访问, 不需要加锁
+    std::map<uid_t, std::string> users;
+    std::map<gid_t, std::string> groups;
+
+    // 目录缓存, 同样只在本线程中访问
+    int inotifyfd;                            // inotify描述符, 缓存关闭时为-1
+    size_t cache_budget;                      // 缓存的内存上限
+    size_t cache_bytes;                       // 缓存当前占用的内存
+    std::map<int, dir_cache_entry> dir_cache; // 以inotify监视描述符为键的缓存项
+    std::list<int> cache_lru;                 // 最近使用的缓存项在前
+
+    // 文件校验和缓存, 同样只在本线程中访问
+    std::map<hash_key, uint32_t> hashes;
+
+    // 描述符用尽时用预留的描述符接受并拒绝连接; 仍然无法接受时暂停监听, 直到有会话关闭或定时器重试
+    int reservefd;         // 预留的描述符, 打开/dev/null
+    bool accept_paused;    // 是否暂停接受连接
+    uint64_t paused_at;    // 暂停时的时间轮刻度
+
+    // 统计计数, 由STAT命令和指标端点汇总所有线程的计数
+    struct loop_stats stats;
+
+    // 等待令牌的会话按先后顺序排队, 有会话排队时定时器每SHAPER_TICK_MS毫秒触发一次, 依次恢复它们;
+    // 否则有会话时每WHEEL_TICK_MS毫秒触发一次, 推进超时的时间轮
+    int timerfd;                          // 定时器描述符
+    long timer_ms;                        // 定时器当前的触发间隔, 为0表示停止
+    std::list<struct session *> throttled; // 等待令牌的会话
+
+    // 等待传输名额的会话, 先到先得; 定时器运行时每次触发都检查其他线程是否释放了名额
+    std::list<struct session *> queued;
+
+    // 本线程所有会话的超时定时器
+    struct timer_wheel wheel;
+};
+
+/**
+ * @brief 所有工作线程的事件循环, 供汇总统计使用
+ */
+static struct event_loop *event_loops;
+static int worker_count;
+static struct timespec server_start;
+
+/**
+ * @brief CRC32C (Castagnoli) 查找表, 在启动时初始化
+ */
+static uint32_t crc32c_table[256];
+
+/**
+ * @brief 用查找表逐字节计算CRC32C
+ * @param crc 当前的校验和
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 更新后的校验和
+ */
+uint32_t crc32c_sw(uint32_t crc, const char *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    while (n-- > 0)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief 用SSE4.2的crc32指令计算CRC32C, 每条指令处理8个字节
+ * @param crc 当前的校验和
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 更新后的校验和
+ */
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const char *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    while (n > 0 && ((uintptr_t)p & 7) != 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        n--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; n >= 8; n -= 8, p += 8)
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+    crc = (uint32_t)crc64;
+#endif
+    for (; n > 0; n--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/**
+ * @brief 根据CPU支持的指令集选择的CRC32C实现
+ */
+static uint32_t (*crc32c_update)(uint32_t, const char *, size_t) = crc32c_sw;
+
+/**
+ * @brief 初始化CRC32C查找表并选择实现, 在创建工作线程之前调用
+ */
+void crc32c_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_hw;
+#endif
+}
+
+/**
+ * @brief 将格式化的应答追加到会话的发送缓冲区
+ * @param s 会话
+ * @param fmt 格式字符串
+ */
+void reply(struct session *s, const char *fmt, ...)
+{
+    char buffer[BUFFER_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (n >= (int)sizeof(buffer))
+        n = sizeof(buffer) - 1;
+    s->outbuf.append(buffer, n);
+}
+
+/**
+ * @brief 增加本线程的一个统计计数. 计数只由所属线程写入, relaxed的读和写编译后就是普通的
+ *        load和store, 比带lock前缀的原子加法便宜, 其他线程读取时也不会读到撕裂的值
+ * @param counter 计数
+ * @param n 增加的值
+ */
+static inline void stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 读取任意线程的一个统计计数
+ * @param counter 计数
+ * @return 计数的值
+ */
+static inline uint64_t stat_read(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 限速配置, 单位字节每秒, 为0表示不限速
+ */
+static double session_rate;
+static double ip_rate;
+static double total_rate;
+static bool shaping;
+
+/**
+ * @brief 所有工作线程共享的令牌桶: 整个服务器一个, 每个客户端IP一个
+ */
+static pthread_mutex_t shaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct token_bucket total_bucket;
+static std::map<in_addr_t, ip_bucket> ip_buckets;
+
+/**
+ * @brief 准入控制的配置, 上限为0表示不限制, 队列长度为0表示不排队; 以及所有工作线程共享的计数, 用原子操作修改.
+ *        会话总数的上限默认按描述符上限计算
+ */
+static int max_sessions = -1;
+static int max_per_ip;
+static int max_transfers;
+static int max_queue = DEFAULT_TRANSFER_QUEUE;
+static int active_sessions;
+static int active_transfers;
+static int queued_transfers;
+
+/**
+ * @brief 超时配置, 单位秒, 为0表示不检查: 空闲等待命令、命令执行中和传输中没有收发数据的最长时间.
+ *        deadline_recheck是仍未超时的会话下次检查的最长间隔, 取其中最短的非0值
+ */
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static int command_timeout = DEFAULT_COMMAND_TIMEOUT;
+static int transfer_timeout = DEFAULT_TRANSFER_TIMEOUT;
+static uint64_t deadline_recheck;
+
+/**
+ * @brief 读取单调时钟
+ * @return 当前时刻, 单位纳秒
+ */
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief 当前时刻对应的时间轮刻度
+ */
+uint64_t wheel_tick()
+{
+    return monotonic_ns() / (WHEEL_TICK_MS * 1000000ull);
+}
+
+/**
+ * @brief 初始化时间轮, 每个槽是空的循环链表
+ * @param w 时间轮
+ * @param now 当前刻度
+ */
+void wheel_init(struct timer_wheel *w, uint64_t now)
+{
+    w->now = now;
+    w->count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        for (int i = 0; i < WHEEL_SLOTS; i++)
+            w->slots[level][i].prev = w->slots[level][i].next = &w->slots[level][i];
+}
+
+/**
+ * @brief 添加定时器. 距离到期不足一圈的放在第0层, 否则放在能容纳这段距离的最低一层;
+ *        超过最高层一整圈的推迟到最高层所能表示的最远刻度
+ * @param w 时间轮
+ * @param t 不在时间轮中的定时器
+ * @param expires 到期的刻度, 不晚于当前刻度时在下一个刻度到期
+ */
+void wheel_add(struct timer_wheel *w, struct wheel_timer *t, uint64_t expires)
+{
+    const uint64_t span = 1ull << (WHEEL_BITS * WHEEL_LEVELS);
+    if (expires <= w->now)
+        expires = w->now + 1;
+    if (expires - w->now >= span)
+        expires = w->now + span - 1;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && expires - w->now >= 1ull << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    struct wheel_timer *head = &w->slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    t->expires = expires;
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    w->count++;
+}
+
+/**
+ * @brief 删除定时器, 不在时间轮中时什么也不做
+ * @param w 时间轮
+ * @param t 定时器
+ */
+void wheel_del(struct timer_wheel *w, struct wheel_timer *t)
+{
+    if (t->prev == NULL)
+        return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    w->count--;
+}
+
+/**
+ * @brief 把上层当前刻度所在的槽中的定时器按剩余的距离重新放入下面各层
+ * @param w 时间轮
+ * @param level 层
+ */
+void wheel_cascade(struct timer_wheel *w, int level)
+{
+    struct wheel_timer *head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    while (head->next != head)
+    {
+        struct wheel_timer *t = head->next;
+        wheel_del(w, t);
+        wheel_add(w, t, t->expires);
+    }
+}
+
+/**
+ * @brief 把时间轮推进到指定刻度, 依次处理经过的每个刻度上到期的定时器
+ * @param w 时间轮
+ * @param tick 目标刻度
+ * @param expire 到期的定时器已经移出时间轮, 回调可以重新添加它
+ */
+void wheel_advance(struct timer_wheel *w, uint64_t tick, void (*expire)(struct wheel_timer *))
+{
+    while (w->now < tick)
+    {
+        w->now++;
+        // 下层转完一圈时, 把上层的下一个槽移下来
+        for (int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if ((w->now & ((1ull << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            wheel_cascade(w, level);
+        }
+
+        struct wheel_timer *head = &w->slots[0][w->now & (WHEEL_SLOTS - 1)];
+        while (head->next != head)
+        {
+            struct wheel_timer *t = head->next;
+            wheel_del(w, t);
+            expire(t);
+        }
+    }
+}
+
+/**
+ * @brief 初始化令牌桶, 开始时装满
+ * @param b 令牌桶
+ * @param rate 每秒的字节数, 为0表示不限速
+ */
+void bucket_init(struct token_bucket *b, double rate)
+{
+    b->rate = rate;
+    b->burst = std::max(rate * SHAPER_BURST_MS / 1000, (double)SHAPER_QUANTUM);
+    b->tokens = b->burst;
+    b->last = monotonic_ns();
+}
+
+/**
+ * @brief 按经过的时间补充令牌
+ * @param b 令牌桶
+ * @param now 当前时刻, 单位纳秒
+ */
+void bucket_refill(struct token_bucket *b, uint64_t now)
+{
+    if (now > b->last)
+        b->tokens = std::min(b->burst, b->tokens + (now - b->last) * b->rate / 1e9);
+    b->last = now;
+}
+
+/**
+ * @brief 计算传输现在最多可以收发的字节数. 每次最多一个SHAPER_QUANTUM, 使排队的传输轮流前进;
+ *        不超过SHAPER_SMALL的小传输不等待令牌, 只透支, 大传输在批量下载时也不会拖慢它们
+ * @param s 会话
+ * @param want 想要收发的字节数
+ * @return 允许的字节数, 为0时会话需要等待令牌
+ */
+size_t shaper_allow(struct session *s, size_t want)
+{
+    if (!shaping || s->filesize - s->filestart <= SHAPER_SMALL)
+        return want;
+    if (want > SHAPER_QUANTUM)
+        want = SHAPER_QUANTUM;
+
+    uint64_t now = monotonic_ns();
+    double avail = want;
+    if (s->bucket.rate > 0)
+    {
+        bucket_refill(&s->bucket, now);
+        avail = std::min(avail, s->bucket.tokens);
+    }
+    if (ip_rate > 0 || total_bucket.rate > 0)
+    {
+        pthread_mutex_lock(&shaper_lock);
+        if (ip_rate > 0)
+        {
+            bucket_refill(&s->ip->bucket, now);
+            avail = std::min(avail, s->ip->bucket.tokens);
+        }
+        if (total_bucket.rate > 0)
+        {
+            bucket_refill(&total_bucket, now);
+            avail = std::min(avail, total_bucket.tokens);
+        }
+        pthread_mutex_unlock(&shaper_lock);
+    }
+    // 令牌太少时等一等, 避免每次只收发几个字节
+    if (avail < want && avail < SHAPER_MIN_GRANT)
+        return 0;
+    return (size_t)avail;
+}
+
+/**
+ * @brief 一次就绪事件中最多收发的字节数. 限速的传输每次只前进一个SHAPER_QUANTUM就让出,
+ *        同时有令牌的几个传输按就绪事件的顺序轮流收发, 不会由一个传输取走所有令牌
+ * @param s 会话
+ * @return 字节数
+ */
+size_t transfer_budget(struct session *s)
+{
+    if (shaping && s->filesize - s->filestart > SHAPER_SMALL)
+        return SHAPER_QUANTUM;
+    return TRANSFER_BUDGET;
+}
+
+/**
+ * @brief 从会话用到的所有令牌桶中扣除实际收发的字节数
+ * @param s 会话
+ * @param n 字节数
+ */
+void shaper_charge(struct session *s, size_t n)
+{
+    s->bucket.tokens -= n;
+    if (ip_rate == 0 && total_bucket.rate == 0)
+        return;
+    pthread_mutex_lock(&shaper_lock);
+    if (ip_rate > 0)
+        s->ip->bucket.tokens -= n;
+    total_bucket.tokens -= n;
+    pthread_mutex_unlock(&shaper_lock);
+}
+
+/**
+ * @brief 按需要设置事件循环的定时器: 有会话等待令牌或传输名额时每SHAPER_TICK_MS毫秒触发一次,
+ *        否则时间轮中有定时器或暂停了接受连接时每WHEEL_TICK_MS毫秒触发一次, 都没有时停止
+ * @param loop 事件循环
+ */
+void update_loop_timer(struct event_loop *loop)
+{
+    long ms = 0;
+    if (!loop->throttled.empty() || !loop->queued.empty())
+        ms = SHAPER_TICK_MS;
+    else if (loop->wheel.count > 0 || loop->accept_paused)
+        ms = WHEEL_TICK_MS;
+    if (ms == loop->timer_ms)
+        return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = its.it_interval.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (ms % 1000) * 1000000L;
+    timerfd_settime(loop->timerfd, 0, &its, NULL);
+    loop->timer_ms = ms;
+}
+
+/**
+ * @brief 传输没有令牌时暂停会话, 排到等待队列末尾, 由定时器恢复
+ * @param s 会话
+ */
+void throttle_session(struct session *s)
+{
+    struct event_loop *loop = s->loop;
+    if (s->throttled)
+        return;
+    s->throttled = true;
+    s->throttle_pos = loop->throttled.insert(loop->throttled.end(), s);
+    update_loop_timer(loop);
+}
+
+/**
+ * @brief 检查新连接是否超过会话总数或单个IP的连接数上限, 通过时计入这两个计数
+ * @param addr 客户端地址
+ * @param ip 保存该IP共享的状态, 不需要时为NULL
+ * @return 通过返回NULL, 否则返回应答给客户端的421信息
+ */
+const char *admit_connection(const struct sockaddr_in &addr, struct ip_bucket **ip)
+{
+    *ip = NULL;
+    if (__atomic_add_fetch(&active_sessions, 1, __ATOMIC_RELAXED) > max_sessions && max_sessions > 0)
+    {
+        __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+        return "421 Too many users, try again later.\r\n";
+    }
+    if (ip_rate == 0 && max_per_ip == 0)
+        return NULL;
+
+    pthread_mutex_lock(&shaper_lock);
+    struct ip_bucket &e = ip_buckets[addr.sin_addr.s_addr];
+    if (max_per_ip > 0 && e.sessions >= max_per_ip)
+    {
+        pthread_mutex_unlock(&shaper_lock);
+        __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+        return "421 Too many connections from your address, try again later.\r\n";
+    }
+    if (e.sessions++ == 0)
+        bucket_init(&e.bucket, ip_rate);
+    *ip = &e;
+    pthread_mutex_unlock(&shaper_lock);
+    return NULL;
+}
+
+/**
+ * @brief 连接关闭时从会话总数和IP的连接数中减去
+ * @param ip 该IP共享的状态, 可以为NULL
+ * @param addr 客户端地址
+ */
+void release_connection(struct ip_bucket *ip, const struct sockaddr_in &addr)
+{
+    __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+    if (ip == NULL)
+        return;
+    pthread_mutex_lock(&shaper_lock);
+    if (--ip->sessions == 0)
+        ip_buckets.erase(addr.sin_addr.s_addr);
+    pthread_mutex_unlock(&shaper_lock);
+}
+
+/**
+ * @brief 占用一个传输名额, 不限制传输数时也计数
+ * @return 成功返回true, 名额已满返回false
+ */
+bool acquire_transfer_slot()
+{
+    if (__atomic_add_fetch(&active_transfers, 1, __ATOMIC_RELAXED) <= max_transfers || max_transfers == 0)
+        return true;
+    __atomic_sub_fetch(&active_transfers, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * @brief 传输结束时释放会话占用的名额
+ * @param s 会话
+ */
+void release_transfer_slot(struct session *s)
+{
+    if (!s->has_slot)
+        return;
+    s->has_slot = false;
+    __atomic_sub_fetch(&active_transfers, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 传输名额已满时把命令放入本线程的等待队列, 会话暂停读取后面的命令
+ * @param s 会话
+ * @param cmd 传输命令
+ * @param arg 命令的参数
+ * @return 成功返回true, 所有线程排队的传输已经达到上限时返回false
+ */
+bool queue_transfer(struct session *s, const struct command_entry *cmd, const char *arg)
+{
+    if (__atomic_add_fetch(&queued_transfers, 1, __ATOMIC_RELAXED) > max_queue)
+    {
+        __atomic_sub_fetch(&queued_transfers, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    s->state = STATE_QUEUED;
+    s->queued_cmd = cmd;
+    s->queued_arg = arg;
+    s->queue_pos = s->loop->queued.insert(s->loop->queued.end(), s);
+    stat_add(&s->loop->stats.transfers_queued, 1);
+    update_loop_timer(s->loop);
+    return true;
+}
+
+/**
+ * @brief 记录会话发送的字节数
+ * @param s 会话
+ * @param n 字节数
+ */
+void count_sent(struct session *s, size_t n)
+{
+    s->active = s->loop->wheel.now;
+    s->bytes_sent += n;
+    stat_add(&s->loop->stats.bytes_sent, n);
+    if (shaping && s->state == STATE_SEND_FILE)
+        shaper_charge(s, n);
+}
+
+/**
+ * @brief 记录会话接收的字节数
+ * @param s 会话
+ * @param n 字节数
+ */
+void count_received(struct session *s, size_t n)
+{
+    s->active = s->loop->wheel.now;
+    s->bytes_received += n;
+    stat_add(&s->loop->stats.bytes_received, n);
+    if (shaping && s->state == STATE_RECV_FILE)
+        shaper_charge(s, n);
+}
+
+/**
+ * @brief 计算两个时刻之间的微秒数
+ */
+uint64_t elapsed_us(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) * 1000000LL + (to.tv_nsec - from.tv_nsec) / 1000;
+}
+
+/**
+ * @brief 结束正在执行的命令, 把它的延迟计入直方图. GET、DIR等命令在会话回到命令状态时才算完成
+ * @param s 会话
+ */
+void finish_command(struct session *s)
+{
+    if (s->command < 0)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t us = elapsed_us(s->command_start, now);
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= STAT_BUCKETS)
+        bucket = STAT_BUCKETS - 1;
+
+    struct command_stats *cs = &s->loop->stats.commands[s->command];
+    stat_add(&cs->buckets[bucket], 1);
+    stat_add(&cs->total_us, us);
+    stat_add(&cs->count, 1);
+    s->commands_done++;
+    s->command = -1;
+}
+
+/**
+ * @brief 尽可能多地发送会话缓冲区中的数据
+ * @param s 会话
+ * @return 缓冲区已清空返回1, 还有剩余数据返回0, 出错返回-1
+ */
+int flush_output(struct session *s)
+{
+    while (s->outpos < s->outbuf.size())
+    {
+        ssize_t n = send(s->sockfd, s->outbuf.data() + s->outpos, s->outbuf.size() - s->outpos, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        s->outpos += n;
+        count_sent(s, n);
+    }
+    s->outbuf.clear();
+    s->outpos = 0;
+    return 1;
+}
+
+/**
+ * @brief 根据会话状态更新在epoll中注册的事件
+ * @param s 会话
+ */
+void update_events(struct session *s)
+{
+    uint32_t events = 0;
+    bool pending = s->outpos < s->outbuf.size();
+
+    // 有待发送的数据或正在发送文件时关注可写事件, 等待令牌的传输由定时器恢复
+    if (pending || (s->state == STATE_SEND_FILE && !s->throttled) || s->state == STATE_SEND_LIST || s->state == STATE_SEND_MLSD ||
+        s->state == STATE_HASH || s->state == STATE_SEND_SUMS || s->state == STATE_CLOSING)
+        events |= EPOLLOUT;
+    // 发送缓冲区积压时暂停读取, 避免内存无限增长
+    if ((s->state == STATE_COMMAND && s->outbuf.size() < MAX_PENDING_OUTPUT) || (s->state == STATE_RECV_FILE && !s->throttled))
+        events |= EPOLLIN;
+
+    if (events == s->events)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(s->loop->epfd, EPOLL_CTL_MOD, s->sockfd, &ev);
+    s->events = events;
+}
+
+/**
+ * @brief 结束当前的文件传输, 会话回到命令状态
+ * @param s 会话
+ */
+void finish_transfer(struct session *s)
+{
+    if (s->filefd >= 0)
+        close(s->filefd);
+    s->filefd = -1;
+    if (s->basefd >= 0)
+        close(s->basefd);
+    s->basefd = -1;
+    delete[] s->dents;
+    s->dents = NULL;
+    delete s->query;
+    s->query = NULL;
+    s->listing.reset();
+    s->capture.reset();
+    s->state = STATE_COMMAND;
+    release_transfer_slot(s);
+}
+
+/**
+ * @brief 创建splice使用的管道
+ * @param s 会话
+ * @return 成功返回0, 失败返回-1
+ */
+int open_transfer_pipe(struct session *s)
+{
+    if (s->pipefd[0] >= 0)
+        return 0;
+    if (pipe2(s->pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+    // 默认的64 KB管道容量会把每次splice限制在很小的块
+    fcntl(s->pipefd[1], F_SETPIPE_SZ, TRANSFER_CHUNK);
+    return 0;
+}
+
+/**
+ * @brief 把PUT收到的数据写入文件, 写入失败后丢弃剩余数据
+ * @param s 会话
+ * @param data 数据指针
+ * @param n 数据长度
+ */
+void write_file_data(struct session *s, const char *data, size_t n)
+{
+    size_t done = 0;
+    while (s->filefd >= 0 && done < n)
+    {
+        ssize_t ret = pwrite(s->filefd, data + done, n - done, s->filepos + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            // 仍然要按长度读完剩余数据, 之后的字节才能作为命令解析
+            close(s->filefd);
+            s->filefd = -1;
+            s->status = 451;
+            break;
+        }
+        done += ret;
+    }
+    s->filepos += n;
+}
+
+/**
+ * @brief 等待回写完成后从页缓存中丢弃的一段文件, 持有自己的描述符, 会话关闭文件不影响它
+ */
+struct writeback_job
+{
+    int fd;        // 文件描述符的副本
+    off_t offset;  // 起始偏移
+    off_t length;  // 长度
+};
+
+/**
+ * @brief 回写线程的任务队列, 工作线程只入队, 等待磁盘的操作都在回写线程中进行
+ */
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_cond = PTHREAD_COND_INITIALIZER;
+static std::list<struct writeback_job> writeback_jobs;
+
+/**
+ * @brief 回写线程: 依次等待每段文件写入磁盘, 然后丢弃它的页缓存
+ * @param arg 未使用
+ * @return 不返回
+ */
+void *writeback_main(void *arg)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&writeback_lock);
+        while (writeback_jobs.empty())
+            pthread_cond_wait(&writeback_cond, &writeback_lock);
+        struct writeback_job job = writeback_jobs.front();
+        writeback_jobs.pop_front();
+        pthread_mutex_unlock(&writeback_lock);
+
+        sync_file_range(job.fd, job.offset, job.length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(job.fd, job.offset, job.length, POSIX_FADV_DONTNEED);
+        close(job.fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief 把一段已经开始回写的文件交给回写线程. 磁盘跟不上网络、队列已满时放弃这一段,
+ *        它的页面已经在回写, 之后由内核按需回收
+ * @param fd 文件描述符
+ * @param offset 起始偏移
+ * @param length 长度
+ */
+void queue_writeback(int fd, off_t offset, off_t length)
+{
+    pthread_mutex_lock(&writeback_lock);
+    if (writeback_jobs.size() < WRITEBACK_QUEUE)
+    {
+        struct writeback_job job = {fcntl(fd, F_DUPFD_CLOEXEC, 0), offset, length};
+        if (job.fd >= 0)
+        {
+            writeback_jobs.push_back(job);
+            pthread_cond_signal(&writeback_cond);
+        }
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/**
+ * @brief 回写模式下每写满一段就启动该段的回写, 不等待完成; 上一段交给回写线程等待写完后从页缓存中丢弃,
+ *        大文件上传既不会积累大量脏页, 也不会挤掉GET使用的热数据, 磁盘较慢时也不阻塞事件循环
+ * @param s 会话
+ */
+void write_behind(struct session *s)
+{
+    if (!s->loop->write_behind || s->filefd < 0)
+        return;
+    while (s->filepos - s->synced >= WRITE_BEHIND_CHUNK)
+    {
+        sync_file_range(s->filefd, s->synced, WRITE_BEHIND_CHUNK, SYNC_FILE_RANGE_WRITE);
+        if (s->synced - s->filestart >= WRITE_BEHIND_CHUNK)
+            queue_writeback(s->filefd, s->synced - WRITE_BEHIND_CHUNK, WRITE_BEHIND_CHUNK);
+        s->synced += WRITE_BEHIND_CHUNK;
+    }
+}
+
+/**
+ * @brief PUT的数据全部到达后发送应答, 会话回到命令状态
+ * @param s 会话
+ */
+void complete_recv_file(struct session *s)
+{
+    // 续传时文件中原有的旧数据可能比新写入的更长, 截掉多余部分
+    if (s->status == 226 && s->filestart > 0 && ftruncate(s->filefd, s->filesize) < 0)
+        s->status = 451;
+    // 开始回写最后不足一段的数据, 不等待完成
+    if (s->status == 226 && s->loop->write_behind && s->filepos > s->synced)
+        sync_file_range(s->filefd, s->synced, s->filepos - s->synced, SYNC_FILE_RANGE_WRITE);
+    if (s->status == 226)
+        log_message(LOG_INFO, "File transfer complete. %lld bytes received.", (long long)(s->filepos - s->filestart));
+
+    // 重建的文件完整后才替换原有文件, 失败时原有文件保持不变
+    if (s->mode == MODE_DELTA)
+    {
+        std::string tmpname = s->target + ".delta~";
+        if (s->status == 226 && renameat(s->dirfd, tmpname.c_str(), s->dirfd, s->target.c_str()) < 0)
+            s->status = 451;
+        if (s->status != 226 && s->status != 450)
+            unlinkat(s->dirfd, tmpname.c_str(), 0);
+    }
+
+    finish_transfer(s);
+    if (s->status == 226)
+        reply(s, "226 Transfer complete.\r\n");
+    else if (s->status == 451)
+        reply(s, "451 Failed to write file.\r\n");
+    else if (s->status == 551)
+        reply(s, "551 Restart offset beyond end of file.\r\n");
+    else if (s->status == 452)
+        reply(s, "452 Insufficient storage space.\r\n");
+    else if (s->status == 450)
+        reply(s, "450 Too many transfers in progress, try again later.\r\n");
+    else
+        reply(s, "550 Failed to create file.\r\n");
+}
+
+/**
+ * @brief 压缩或增量模式下当前数据块还需要接收的字节数
+ * @param s 会话
+ * @return 字节数, 数据块已经完整时返回0
+ */
+size_t compressed_frame_need(struct session *s)
+{
+    // 每个数据块是4字节的网络字节序头部加数据, 头部的最高位表示数据未压缩, 长度为0的块表示结束;
+    // 增量模式下最高位表示引用原有文件中的一块, 剩余位是块号, 没有数据
+    if (s->zbuf.size() < 4)
+        return 4 - s->zbuf.size();
+    uint32_t header = ntohl(*(const uint32_t *)s->zbuf.data());
+    if (s->mode == MODE_DELTA && (header & FRAME_COPY))
+        return 0;
+    return 4 + (header & ~FRAME_FLAG) - s->zbuf.size();
+}
+
+/**
+ * @brief 把原有文件中的一块复制到重建的文件中, 同一文件系统上由内核直接复制
+ * @param s 会话
+ * @param index 块号
+ * @return 成功返回0, 原有文件中没有这一块返回-1
+ */
+int copy_base_block(struct session *s, uint32_t index)
+{
+    off_t from = (off_t)index * s->blocksize;
+    off_t left = s->blocksize;
+    while (left > 0 && s->filefd >= 0)
+    {
+        off_t to = s->filepos;
+        ssize_t n = copy_file_range(s->basefd, &from, s->filefd, &to, left, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            break;
+        if (n <= 0)
+            return -1;
+        s->filepos += n;
+        left -= n;
+    }
+
+    // 不支持copy_file_range时经过用户空间缓冲区复制
+    char buffer[TRANSFER_CHUNK];
+    while (left > 0 && s->filefd >= 0)
+    {
+        ssize_t n = pread(s->basefd, buffer, std::min((size_t)left, sizeof(buffer)), from);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        write_file_data(s, buffer, n);
+        from += n;
+        left -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief 处理增量模式下一个完整的数据块
+ * @param s 会话
+ * @return 成功返回0, 数据块格式错误返回-1
+ */
+int finish_delta_frame(struct session *s)
+{
+    uint32_t header = ntohl(*(const uint32_t *)s->zbuf.data());
+    s->zbuf.erase(0, 4);
+    if (header & FRAME_COPY)
+    {
+        if (s->filepos + s->blocksize > s->filesize)
+            return -1;
+        // 原有文件在SUMS之后被截断时引用的块已经不存在, 重建失败但仍然读完剩余数据
+        off_t end = s->filepos + s->blocksize;
+        if (s->basefd >= 0 && copy_base_block(s, header & ~FRAME_FLAG) < 0 && s->filefd >= 0)
+        {
+            close(s->filefd);
+            s->filefd = -1;
+            s->status = 451;
+        }
+        s->filepos = end;
+    }
+    else
+    {
+        if (s->filepos + (off_t)s->zbuf.size() > s->filesize)
+            return -1;
+        write_file_data(s, s->zbuf.data(), s->zbuf.size());
+    }
+    s->zbuf.clear();
+    write_behind(s);
+    return 0;
+}
+
+/**
+ * @brief 解压一个完整的数据块并写入文件
+ * @param s 会话
+ * @return 成功返回0, 数据块格式错误返回-1
+ */
+int finish_compressed_frame(struct session *s)
+{
+    uint32_t header = ntohl(*(const uint32_t *)s->zbuf.data());
+    uint32_t len = header & ~FRAME_FLAG;
+    const char *payload = s->zbuf.data() + 4;
+
+    if (len == 0 && !(s->mode == MODE_DELTA && (header & FRAME_COPY)))
+    {
+        s->zbuf.clear();
+        if (s->filepos != s->filesize)
+            return -1;
+        complete_recv_file(s);
+        return 0;
+    }
+    if (s->mode == MODE_DELTA)
+        return finish_delta_frame(s);
+
+    char buffer[TRANSFER_CHUNK];
+    uLongf n = sizeof(buffer);
+    if (header & FRAME_STORED)
+    {
+        if (len > sizeof(buffer))
+            return -1;
+        memcpy(buffer, payload, len);
+        n = len;
+    }
+    else if (uncompress((Bytef *)buffer, &n, (const Bytef *)payload, len) != Z_OK)
+    {
+        return -1;
+    }
+    if (s->filepos + (off_t)n > s->filesize)
+        return -1;
+
+    s->zbuf.clear();
+    write_file_data(s, buffer, n);
+    write_behind(s);
+    return 0;
+}
+
+/**
+ * @brief 处理压缩或增量模式下收到的数据
+ * @param s 会话
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 属于文件内容的字节数, 数据块格式错误返回-1
+ */
+ssize_t recv_compressed_data(struct session *s, const char *data, size_t n)
+{
+    size_t used = 0;
+    while (used < n && s->state == STATE_RECV_FILE)
+    {
+        size_t take = compressed_frame_need(s);
+        if (take > n - used)
+            take = n - used;
+        s->zbuf.append(data + used, take);
+        used += take;
+
+        // 头部完整后先检查长度, 防止错误的头部导致分配过多内存
+        if (s->zbuf.size() == 4 && compressed_frame_need(s) > compressBound(TRANSFER_CHUNK))
+            return -1;
+        if (compressed_frame_need(s) == 0 && finish_compressed_frame(s) < 0)
+            return -1;
+    }
+    return used;
+}
+
+/**
+ * @brief 处理PUT传输中已经读入用户空间的数据
+ * @param s 会话
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 属于文件内容的字节数, 其余字节属于后续命令; 数据格式错误返回-1
+ */
+ssize_t recv_file_data(struct session *s, const char *data, size_t n)
+{
+    if (s->mode == MODE_DEFLATE || s->mode == MODE_DELTA)
+        return recv_compressed_data(s, data, n);
+
+    size_t left = s->filesize - s->filepos - s->pipelen;
+    if (n > left)
+        n = left;
+    write_file_data(s, data, n);
+    write_behind(s);
+    if (s->filepos == s->filesize)
+        complete_recv_file(s);
+    return n;
+}
+
+/**
+ * @brief 从指定的会话接收文件数据并保存到指定的文件中
+ * @param s 会话
+ * @param filename 要保存的文件名
+ * @param offset 写入的起始偏移, 大于0时保留文件中该偏移之前的内容
+ * @param size 客户端声明的数据长度
+ * @param mode 数据的格式, MODE_SPLICE为原始数据, MODE_DEFLATE和MODE_DELTA为数据块
+ */
+void recv_file(struct session *s, const char *filename, off_t offset, off_t size, enum transfer_mode mode)
+{
+    // 创建本地文件, 失败时仍然按长度接收并丢弃数据; 传输队列已满时同样接收并丢弃, 最后应答450
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? 0 : O_TRUNC);
+    s->filefd = s->refused ? -1 : openat(s->dirfd, filename, flags, 0666);
+    s->status = s->refused ? 450 : (s->filefd < 0 ? 550 : 226);
+
+    // 续传的偏移不能超过已有文件的长度, 否则文件中会留下空洞
+    struct stat file_stat;
+    if (s->filefd >= 0 && offset > 0 && (fstat(s->filefd, &file_stat) < 0 || offset > file_stat.st_size))
+    {
+        close(s->filefd);
+        s->filefd = -1;
+        s->status = 551;
+    }
+
+    // 按声明的长度预先分配磁盘空间, 减少碎片并尽早发现空间不足;
+    // 保持文件长度不变, 中断的上传仍然可以按实际长度续传
+    if (s->filefd >= 0 && size > 0 && fallocate(s->filefd, FALLOC_FL_KEEP_SIZE, offset, size) < 0 && errno == ENOSPC)
+    {
+        close(s->filefd);
+        s->filefd = -1;
+        s->status = 452;
+    }
+
+    s->filestart = offset;
+    s->filepos = offset;
+    s->filesize = offset + size;
+    s->synced = offset;
+    s->mode = mode;
+    s->zbuf.clear();
+    s->state = STATE_RECV_FILE;
+    // 数据块格式下即使长度为0也要等待结束块
+    if (size == 0 && s->mode == MODE_SPLICE)
+        complete_recv_file(s);
+}
+
+/**
+ * @brief 接收增量数据, 用原有文件中的块和字面数据在临时文件中重建文件, 完成后替换原有文件
+ * @param s 会话
+ * @param filename 要更新的文件名
+ * @param size 重建后的文件长度
+ * @param blocksize 客户端使用的SUMS块大小
+ */
+void recv_delta_file(struct session *s, const char *filename, off_t size, off_t blocksize)
+{
+    s->target = filename;
+    s->blocksize = blocksize;
+    recv_file(s, (s->target + ".delta~").c_str(), 0, size, MODE_DELTA);
+
+    // 重建的文件继承原有文件的权限
+    struct stat file_stat;
+    s->basefd = openat(s->dirfd, filename, O_RDONLY | O_CLOEXEC);
+    if (s->basefd >= 0 && fstat(s->basefd, &file_stat) == 0 && s->filefd >= 0)
+        fchmod(s->filefd, file_stat.st_mode & 07777);
+    else if (s->filefd >= 0)
+    {
+        close(s->filefd);
+        s->filefd = -1;
+        s->status = 550;
+    }
+}
+
+/**
+ * @brief 发送文件每个完整块的弱校验和与强校验和, 供客户端计算增量
+ * @param s 会话
+ * @param filename 文件名
+ * @param blocksize 块大小
+ */
+void send_block_sums(struct session *s, const char *filename, off_t blocksize)
+{
+    s->filefd = openat(s->dirfd, filename, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (s->filefd >= 0 && (fstat(s->filefd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)))
+    {
+        close(s->filefd);
+        s->filefd = -1;
+    }
+    if (s->filefd < 0)
+    {
+        reply(s, "550 Failed to open file.\r\n");
+        return;
+    }
+
+    // 只发送完整的块, 文件末尾不足一块的部分由客户端作为字面数据发送
+    long long blocks = file_stat.st_size / blocksize;
+    posix_fadvise(s->filefd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    s->blocksize = blocksize;
+    s->filestart = 0;
+    s->filepos = 0;
+    s->filesize = blocks * blocksize;
+    s->state = STATE_SEND_SUMS;
+    reply(s, "150 %lld blocks of %lld bytes.\r\n", blocks, (long long)blocksize);
+}
+
+/**
+ * @brief 计算一块数据的滚动弱校验和, 与rsync的算法相同
+ * @param data 数据指针
+ * @param n 数据长度
+ * @return 弱校验和, 低16位是字节和, 高16位是加权和
+ */
+uint32_t weak_checksum(const char *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        a += p[i];
+        b += (uint32_t)(n - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * @brief 继续计算并发送分块校验和, 发送缓冲区积压时等待下一次可写事件
+ * @param s 会话
+ * @return 成功返回0, 文件在计算中被截断返回-1
+ */
+int continue_send_sums(struct session *s)
+{
+    char buffer[TRANSFER_CHUNK];
+    size_t per_read = sizeof(buffer) / s->blocksize * s->blocksize;
+    for (size_t done = 0; done < HASH_BUDGET && s->filepos < s->filesize && s->outbuf.size() < MAX_PENDING_OUTPUT;)
+    {
+        size_t want = std::min((off_t)per_read, s->filesize - s->filepos);
+        ssize_t n = pread(s->filefd, buffer, want, s->filepos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // 已经宣告了块数, 无法补齐时只能关闭连接
+        if (n != (ssize_t)want)
+            return -1;
+        for (size_t off = 0; off < want; off += s->blocksize)
+        {
+            uint32_t sums[2];
+            sums[0] = htonl(weak_checksum(buffer + off, s->blocksize));
+            sums[1] = htonl(~crc32c_update(0xFFFFFFFFu, buffer + off, s->blocksize));
+            s->outbuf.append((const char *)sums, sizeof(sums));
+        }
+        s->filepos += n;
+        done += n;
+    }
+    if (s->filepos < s->filesize)
+        return 0;
+
+    finish_transfer(s);
+    reply(s, "226 Transfer complete.\r\n");
+    return 0;
+}
+
+/**
+ * @brief 把管道中的数据写入文件, 文件系统不支持splice时经过用户空间缓冲区写入
+ * @param s 会话
+ * @return 成功返回0, 出错返回-1
+ */
+int flush_pipe_to_file(struct session *s)
+{
+    while (s->pipelen > 0)
+    {
+        if (s->filefd >= 0 && s->mode == MODE_SPLICE)
+        {
+            ssize_t n = splice(s->pipefd[0], NULL, s->filefd, &s->filepos, s->pipelen, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n > 0)
+            {
+                s->pipelen -= n;
+                continue;
+            }
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+                s->mode = MODE_BUFFERED;
+        }
+
+        // 读出管道中的数据, 写入文件或在出错后丢弃
+        char buffer[BUFFER_SIZE * 16];
+        ssize_t m = read(s->pipefd[0], buffer, s->pipelen < sizeof(buffer) ? s->pipelen : sizeof(buffer));
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0)
+            return -1;
+        s->pipelen -= m;
+        write_file_data(s, buffer, m);
+    }
+    return 0;
+}
+
+/**
+ * @brief 套接字可读时继续接收文件数据
+ * @param s 会话
+ * @return 成功返回0, 客户端断开或出错返回-1
+ */
+int continue_recv_file(struct session *s)
+{
+    // 每次可读事件最多接收TRANSFER_BUDGET字节, 避免饿死同一线程中的其他会话
+    char buffer[TRANSFER_CHUNK];
+    size_t budget = transfer_budget(s);
+    while (s->state == STATE_RECV_FILE && budget > 0)
+    {
+        // 只读取声明的长度, 之后的字节留在套接字中作为命令
+        size_t want = s->filesize - s->filepos;
+        if (want > budget)
+            want = budget;
+        if (want > TRANSFER_CHUNK)
+            want = TRANSFER_CHUNK;
+
+        // 限速时最多接收令牌允许的字节数, 没有令牌时暂停读取
+        size_t allowed = shaper_allow(s, TRANSFER_CHUNK);
+        if (allowed == 0)
+        {
+            throttle_session(s);
+            return 0;
+        }
+        if (want > allowed)
+            want = allowed;
+
+        ssize_t n;
+        if (s->mode == MODE_DEFLATE || s->mode == MODE_DELTA)
+        {
+            // 只读取当前数据块的剩余部分, 结束块之后的字节留在套接字中作为命令; 同样不超过本次事件的预算
+            size_t limit = std::min(std::min(compressed_frame_need(s), sizeof(buffer)), std::min(allowed, budget));
+            n = recv(s->sockfd, buffer, limit, 0);
+            if (n > 0 && recv_compressed_data(s, buffer, n) < 0)
+                return -1;
+        }
+        else if (s->mode == MODE_SPLICE && s->filefd >= 0)
+        {
+            if (open_transfer_pipe(s) < 0)
+            {
+                s->mode = MODE_BUFFERED;
+                continue;
+            }
+            n = splice(s->sockfd, NULL, s->pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                s->mode = MODE_BUFFERED;
+                continue;
+            }
+            if (n > 0)
+            {
+                s->pipelen = n;
+                if (flush_pipe_to_file(s) < 0)
+                    return -1;
+            }
+        }
+        else
+        {
+            n = recv(s->sockfd, buffer, want, 0);
+            if (n > 0)
+                write_file_data(s, buffer, n);
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        if (n == 0)
+            return -1;
+        count_received(s, n);
+        budget -= (size_t)n < budget ? n : budget;
+        write_behind(s);
+        if (s->state == STATE_RECV_FILE && s->mode != MODE_DEFLATE && s->mode != MODE_DELTA && s->filepos == s->filesize)
+            complete_recv_file(s);
+    }
+    return 0;
+}
+
+/**
+ * @brief 从指定的会话发送指定文件中一段范围的内容
+ * @param s 会话
+ * @param filename 要发送的文件名
+ * @param offset 起始偏移
+ * @param length 最多发送的字节数, 为-1时发送到文件末尾
+ */
+void send_file(struct session *s, const char *filename, off_t offset, off_t length)
+{
+    if (s->refused)
+    {
+        reply(s, "450 Too many transfers in progress, try again later.\r\n");
+        return;
+    }
+
+    // 打开本地文件
+    s->filefd = openat(s->dirfd, filename, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (s->filefd >= 0 && (fstat(s->filefd, &file_stat) < 0 || S_ISDIR(file_stat.st_mode)))
+    {
+        close(s->filefd);
+        s->filefd = -1;
+    }
+    if (s->filefd < 0)
+    {
+        reply(s, "550 Failed to open file.\r\n");
+        return;
+    }
+
+    if (offset > file_stat.st_size)
+    {
+        close(s->filefd);
+        s->filefd = -1;
+        reply(s, "551 Requested range not satisfiable.\r\n");
+        return;
+    }
+    if (length < 0 || length > file_stat.st_size - offset)
+        length = file_stat.st_size - offset;
+
+    // 先告知长度, 客户端按长度接收, 不需要扫描数据中的结束标记
+    reply(s, "150 %lld bytes.\r\n", (long long)length);
+    s->filestart = offset;
+    s->filepos = offset;
+    s->filesize = offset + length;
+    s->mode = s->zlevel > 0 ? MODE_DEFLATE : MODE_SENDFILE;
+    s->zstored = 0;
+    s->state = STATE_SEND_FILE;
+}
+
+/**
+ * @brief 用sendfile发送文件数据
+ * @param s 会话
+ * @param limit 本次最多发送的字节数
+ * @return 发送的字节数, 文件结束返回0, 套接字暂时不可写或出错返回-1并设置errno
+ */
+ssize_t send_file_sendfile(struct session *s, size_t limit)
+{
+    ssize_t n = sendfile(s->sockfd, s->filefd, &s->filepos, limit);
+    if (n > 0)
+        count_sent(s, n);
+    return n;
+}
+
+/**
+ * @brief 用splice经过管道发送文件数据
+ * @param s 会话
+ * @param limit 本次最多从文件读取的字节数
+ * @return 发送的字节数, 文件结束返回0, 套接字暂时不可写或出错返回-1并设置errno
+ */
+ssize_t send_file_splice(struct session *s, size_t limit)
+{
+    if (open_transfer_pipe(s) < 0)
+        return -1;
+
+    // 管道为空时先从文件填充
+    if (s->pipelen == 0)
+    {
+        ssize_t n = splice(s->filefd, &s->filepos, s->pipefd[1], NULL, limit, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0)
+            return n;
+        s->pipelen = n;
+    }
+
+    ssize_t n = splice(s->pipefd[0], NULL, s->sockfd, NULL, s->pipelen, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0)
+    {
+        s->pipelen -= n;
+        count_sent(s, n);
+    }
+    return n;
+}
+
+/**
+ * @brief 用read+send经过用户空间缓冲区发送文件数据
+ * @param s 会话
+ * @param limit 本次最多发送的字节数
+ * @return 发送的字节数, 文件结束返回0, 套接字暂时不可写或出错返回-1并设置errno
+ */
+ssize_t send_file_buffered(struct session *s, size_t limit)
+{
+    char buffer[BUFFER_SIZE * 64];
+    ssize_t n = pread(s->filefd, buffer, limit < sizeof(buffer) ? limit : sizeof(buffer), s->filepos);
+    if (n <= 0)
+        return n;
+    s->filepos += n;
+
+    // 未能立即发出的部分留在发送缓冲区, 等待下一次可写事件
+    s->outbuf.append(buffer, n);
+    if (flush_output(s) < 0)
+        return -1;
+    if (s->outpos < s->outbuf.size())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief 读取一个数据块, 压缩后按MODE Z的格式发送
+ * @param s 会话
+ * @param limit 本次最多读取的字节数
+ * @return 读取的原始字节数, 文件结束返回0, 套接字暂时不可写或出错返回-1并设置errno
+ */
+ssize_t send_file_deflate(struct session *s, size_t limit)
+{
+    char buffer[TRANSFER_CHUNK];
+    ssize_t n = pread(s->filefd, buffer, std::min(limit, sizeof(buffer)), s->filepos);
+    if (n <= 0)
+        return n;
+    s->filepos += n;
+
+    // 连续几个数据块都压缩不了时认为文件已经压缩过, 剩余部分不再经过压缩
+    std::string frame(4 + compressBound(n), '\0');
+    uLongf len = frame.size() - 4;
+    uint32_t header;
+    if (s->zstored < INCOMPRESSIBLE_LIMIT &&
+        compress2((Bytef *)&frame[4], &len, (const Bytef *)buffer, n, s->zlevel) == Z_OK && len < (uLongf)n)
+    {
+        s->zstored = 0;
+        header = htonl(len);
+    }
+    else
+    {
+        s->zstored++;
+        memcpy(&frame[4], buffer, n);
+        len = n;
+        header = htonl(len | FRAME_STORED);
+    }
+    memcpy(&frame[0], &header, 4);
+    s->outbuf.append(frame, 0, 4 + len);
+
+    // 未能立即发出的部分留在发送缓冲区, 等待下一次可写事件
+    if (flush_output(s) < 0)
+        return -1;
+    if (s->outpos < s->outbuf.size())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief 套接字可写时继续发送文件数据
+ * @param s 会话
+ * @return 成功返回0, 出错返回-1
+ */
+int continue_send_file(struct session *s)
+{
+    // 每次可写事件最多发送TRANSFER_BUDGET字节, 避免一个大文件饿死同一线程中的其他会话
+    size_t budget = transfer_budget(s);
+    while (s->filepos < s->filesize || s->pipelen > 0)
+    {
+        if (budget == 0)
+            return 0;
+
+        // 只发送宣告的长度, 文件在传输中变长时多出的部分不发送
+        size_t limit = s->filesize - s->filepos;
+        if (limit > budget)
+            limit = budget;
+        if (limit > TRANSFER_CHUNK)
+            limit = TRANSFER_CHUNK;
+
+        // 限速时最多发送令牌允许的字节数, 没有令牌时暂停; 管道中已经读出的数据照常发完
+        if (limit > 0)
+        {
+            limit = shaper_allow(s, limit);
+            if (limit == 0)
+            {
+                throttle_session(s);
+                return 0;
+            }
+        }
+
+        ssize_t n;
+        if (s->mode == MODE_SENDFILE)
+            n = send_file_sendfile(s, limit);
+        else if (s->mode == MODE_SPLICE)
+            n = send_file_splice(s, limit);
+        else if (s->mode == MODE_DEFLATE)
+            n = send_file_deflate(s, limit);
+        else
+            n = send_file_buffered(s, limit);
+
+        if (n > 0)
+        {
+            budget -= (size_t)n < budget ? n : budget;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS) && (s->mode == MODE_SENDFILE || s->mode == MODE_SPLICE) && s->pipelen == 0)
+        {
+            // 文件系统或套接字不支持当前方式, 降级后重试
+            s->mode = s->mode == MODE_SENDFILE ? MODE_SPLICE : MODE_BUFFERED;
+            continue;
+        }
+        // 文件在传输中被截断时无法补齐宣告的长度, 只能关闭连接
+        return -1;
+    }
+
+    log_message(LOG_INFO, "File transfer complete. %lld bytes sent.", (long long)(s->filepos - s->filestart));
+
+    // 压缩模式以长度为0的数据块结束
+    if (s->mode == MODE_DEFLATE)
+        s->outbuf.append(4, '\0');
+    finish_transfer(s);
+    reply(s, "226 Transfer complete.\r\n");
+    return 0;
+}
+
+/**
+ * @brief 调整缓存占用的内存, 超出上限时从最久未使用的缓存项开始淘汰. 增加内存的缓存项刚刚使用过,
+ *        先移到最前面, 淘汰时不会选中它
+ * @param loop 事件循环
+ * @param e 缓存项
+ * @param delta 增加的字节数, 可以为负数
+ */
+void dir_cache_charge(struct event_loop *loop, struct dir_cache_entry *e, long delta)
+{
+    e->bytes += delta;
+    loop->cache_bytes += delta;
+    if (delta > 0)
+        loop->cache_lru.splice(loop->cache_lru.begin(), loop->cache_lru, e->lru);
+    while (loop->cache_bytes > loop->cache_budget && loop->cache_lru.size() > 1)
+    {
+        int wd = loop->cache_lru.back();
+        struct dir_cache_entry &victim = loop->dir_cache[wd];
+        loop->cache_bytes -= victim.bytes;
+        loop->cache_lru.pop_back();
+        loop->dir_cache.erase(wd);
+        inotify_rm_watch(loop->inotifyfd, wd);
+    }
+}
+
+/**
+ * @brief 使缓存项失效
+ * @param loop 事件循环
+ * @param e 缓存项
+ * @param name 发生变化的文件名, 为NULL时整个目录的结果都失效
+ */
+void dir_cache_invalidate(struct event_loop *loop, struct dir_cache_entry *e, const char *name)
+{
+    long freed = 0;
+    e->generation++;
+    if (e->listing)
+    {
+        freed += e->listing->size();
+        e->listing.reset();
+    }
+    if (name == NULL)
+    {
+        for (std::map<std::string, off_t>::iterator it = e->sizes.begin(); it != e->sizes.end(); ++it)
+            freed += it->first.size() + sizeof(off_t);
+        e->sizes.clear();
+    }
+    else if (e->sizes.erase(name) > 0)
+    {
+        freed += strlen(name) + sizeof(off_t);
+    }
+    dir_cache_charge(loop, e, -freed);
+}
+
+/**
+ * @brief 读出所有等待处理的inotify事件并使相应的缓存项失效
+ * @param loop 事件循环
+ */
+void drain_dir_cache_events(struct event_loop *loop)
+{
+    char buf[LIST_CHUNK] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        ssize_t n = read(loop->inotifyfd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        for (char *p = buf; p < buf + n;)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                // 丢失了事件, 无法判断哪些缓存项仍然有效
+                for (std::map<int, dir_cache_entry>::iterator it = loop->dir_cache.begin(); it != loop->dir_cache.end(); ++it)
+                    dir_cache_invalidate(loop, &it->second, NULL);
+                continue;
+            }
+
+            std::map<int, dir_cache_entry>::iterator it = loop->dir_cache.find(ev->wd);
+            if (it == loop->dir_cache.end())
+                continue;
+            if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+            {
+                // 目录本身被删除或移走, 丢弃整个缓存项
+                loop->cache_bytes -= it->second.bytes;
+                loop->cache_lru.erase(it->second.lru);
+                loop->dir_cache.erase(it);
+                if (!(ev->mask & IN_IGNORED))
+                    inotify_rm_watch(loop->inotifyfd, ev->wd);
+                continue;
+            }
+            dir_cache_invalidate(loop, &it->second, ev->len > 0 ? ev->name : NULL);
+        }
+    }
+}
+
+/**
+ * @brief 查找会话当前目录的缓存项, 不存在时开始监视该目录并创建空的缓存项
+ * @param s 会话
+ * @return 缓存项, 缓存关闭或无法监视时返回NULL
+ */
+struct dir_cache_entry *dir_cache_lookup(struct session *s)
+{
+    struct event_loop *loop = s->loop;
+    if (loop->inotifyfd < 0)
+        return NULL;
+
+    // 内核在文件系统操作时同步排队inotify事件, 先处理完再使用缓存就不会读到过期的结果.
+    // 因此每次查找都有一次非阻塞的read, 命中缓存省掉的是getdents64和逐个文件的fstatat
+    drain_dir_cache_events(loop);
+
+    std::map<int, dir_cache_entry>::iterator it = loop->dir_cache.find(s->dirwd);
+    if (it == loop->dir_cache.end())
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", s->dirfd);
+        s->dirwd = inotify_add_watch(loop->inotifyfd, path, DIR_CACHE_EVENTS | IN_ONLYDIR);
+        if (s->dirwd < 0)
+            return NULL;
+
+        // 其他会话可能已经为同一目录建立了缓存项
+        it = loop->dir_cache.find(s->dirwd);
+        if (it == loop->dir_cache.end())
+        {
+            struct dir_cache_entry &e = loop->dir_cache[s->dirwd];
+            e.wd = s->dirwd;
+            e.generation = 0;
+            e.bytes = 0;
+            loop->cache_lru.push_front(s->dirwd);
+            e.lru = loop->cache_lru.begin();
+            return &e;
+        }
+    }
+
+    loop->cache_lru.splice(loop->cache_lru.begin(), loop->cache_lru, it->second.lru);
+    return &it->second;
+}
+
+/**
+ * @brief 生成文件的校验和缓存键
+ * @param st 文件状态
+ * @return 缓存键
+ */
+struct hash_key make_hash_key(const struct stat &st)
+{
+    struct hash_key key;
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    key.ctime_ns = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+    return key;
+}
+
+/**
+ * @brief 计算文件的CRC32C校验和, 文件没有变化时直接使用缓存的结果
+ * @param s 会话
+ * @param filename 文件名
+ */
+void send_file_hash(struct session *s, const char *filename)
+{
+    s->filefd = openat(s->dirfd, filename, O_RDONLY | O_CLOEXEC);
+    if (s->filefd >= 0 && (fstat(s->filefd, &s->hashstat) < 0 || !S_ISREG(s->hashstat.st_mode)))
+    {
+        close(s->filefd);
+        s->filefd = -1;
+    }
+    if (s->filefd < 0)
+    {
+        reply(s, "550 Failed to open file.\r\n");
+        return;
+    }
+
+    std::map<hash_key, uint32_t>::iterator it = s->loop->hashes.find(make_hash_key(s->hashstat));
+    if (it != s->loop->hashes.end())
+    {
+        finish_transfer(s);
+        reply(s, "213 crc32c=%08x size=%lld\r\n", it->second, (long long)s->hashstat.st_size);
+        return;
+    }
+
+    // 大文件分多次在套接字可写时计算, 不会长时间阻塞同一线程中的其他会话
+    posix_fadvise(s->filefd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    s->crc = 0xFFFFFFFFu;
+    s->filepos = 0;
+    s->filesize = s->hashstat.st_size;
+    s->state = STATE_HASH;
+}
+
+/**
+ * @brief 继续计算文件的校验和
+ * @param s 会话
+ * @return 成功返回0, 出错返回-1
+ */
+int continue_file_hash(struct session *s)
+{
+    char buffer[TRANSFER_CHUNK];
+    for (size_t done = 0; done < HASH_BUDGET && s->filepos < s->filesize;)
+    {
+        ssize_t n = pread(s->filefd, buffer, sizeof(buffer), s->filepos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            // 文件在计算过程中被截断, 结果没有意义
+            finish_transfer(s);
+            reply(s, "451 File changed while hashing.\r\n");
+            return 0;
+        }
+        s->crc = crc32c_update(s->crc, buffer, n);
+        s->filepos += n;
+        done += n;
+    }
+    if (s->filepos < s->filesize)
+        return 0;
+
+    // 计算期间文件被修改时不缓存结果
+    uint32_t crc = ~s->crc;
+    struct stat file_stat;
+    struct hash_key key = make_hash_key(s->hashstat);
+    if (fstat(s->filefd, &file_stat) == 0 && file_stat.st_size == s->hashstat.st_size &&
+        make_hash_key(file_stat).mtime_ns == key.mtime_ns && make_hash_key(file_stat).ctime_ns == key.ctime_ns)
+    {
+        if (s->loop->hashes.size() >= HASH_CACHE_MAX)
+            s->loop->hashes.erase(s->loop->hashes.begin());
+        s->loop->hashes[key] = crc;
+    }
+
+    finish_transfer(s);
+    reply(s, "213 crc32c=%08x size=%lld\r\n", crc, (long long)s->filesize);
+    return 0;
+}
+
+/**
+ * @brief 向客户端发送指定文件的大小信息
+ * @param s 会话
+ * @param filename 要计算大小的文件名
+ */
+void send_file_size(struct session *s, const char *filename)
+{
+    // 只缓存当前目录中的文件, 带路径的名字涉及其他目录
+    struct dir_cache_entry *e = strchr(filename, '/') == NULL ? dir_cache_lookup(s) : NULL;
+    off_t size;
+    std::map<std::string, off_t>::iterator it;
+    if (e != NULL && (it = e->sizes.find(filename)) != e->sizes.end())
+    {
+        size = it->second;
+    }
+    else
+    {
+        // 符号链接指向的文件变化时本目录没有inotify事件, 不缓存它的结果
+        struct stat file_stat;
+        int ret = fstatat(s->dirfd, filename, &file_stat, AT_SYMLINK_NOFOLLOW);
+        bool link = ret == 0 && S_ISLNK(file_stat.st_mode);
+        if (link)
+            ret = fstatat(s->dirfd, filename, &file_stat, 0);
+        size = ret < 0 || S_ISDIR(file_stat.st_mode) ? -1 : file_stat.st_size;
+        if (e != NULL && !link)
+        {
+            e->sizes[filename] = size;
+            dir_cache_charge(s->loop, e, strlen(filename) + sizeof(off_t));
+        }
+    }
+
+    if (size < 0)
+        reply(s, "550 Failed to open file.\r\n");
+    else
+        reply(s, "%lld bytes.\r\n", (long long)size);
+}
+
+/**
+ * @brief 获取会话当前工作目录的路径
+ * @param s 会话
+ * @param buf 保存路径的缓冲区
+ * @param size 缓冲区大小
+ */
+void get_session_cwd(struct session *s, char *buf, size_t size)
+{
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", s->dirfd);
+    ssize_t n = readlink(link, buf, size - 1);
+    if (n < 0)
+        n = 0;
+    buf[n] = '\0';
+}
+
+/**
+ * @brief 查询用户名, 结果缓存在事件循环中
+ * @param loop 事件循环
+ * @param uid 用户ID
+ * @return 用户名, 查询不到时返回空串
+ */
+const char *lookup_user_name(struct event_loop *loop, uid_t uid)
+{
+    std::map<uid_t, std::string>::iterator it = loop->users.find(uid);
+    if (it != loop->users.end())
+        return it->second.c_str();
+
+    char buf[BUFFER_SIZE];
+    struct passwd pw, *pwp = NULL;
+    std::string &name = loop->users[uid];
+    if (getpwuid_r(uid, &pw, buf, sizeof(buf), &pwp) == 0 && pwp != NULL)
+        name = pw.pw_name;
+    return name.c_str();
+}
+
+/**
+ * @brief 查询组名, 结果缓存在事件循环中
+ * @param loop 事件循环
+ * @param gid 组ID
+ * @return 组名, 查询不到时返回空串
+ */
+const char *lookup_group_name(struct event_loop *loop, gid_t gid)
+{
+    std::map<gid_t, std::string>::iterator it = loop->groups.find(gid);
+    if (it != loop->groups.end())
+        return it->second.c_str();
+
+    char buf[BUFFER_SIZE];
+    struct group gr, *grp = NULL;
+    std::string &name = loop->groups[gid];
+    if (getgrgid_r(gid, &gr, buf, sizeof(buf), &grp) == 0 && grp != NULL)
+        name = gr.gr_name;
+    return name.c_str();
+}
+
+/**
+ * @brief 格式化一个目录项并追加到发送缓冲区
+ * @param s 会话
+ * @param name 文件名
+ * @param d_type getdents64返回的文件类型
+ * @return 列表中显示的文件类型, 目录项不提供类型时由文件状态决定
+ */
+unsigned char format_directory_entry(struct session *s, const char *name, unsigned char d_type)
+{
+    struct stat file_stat;
+    char perm[10] = "";
+    if (fstatat(s->dirfd, name, &file_stat, 0) == 0)
+    {
+        mode_t mode = file_stat.st_mode;
+        perm[0] = (mode & S_IRUSR) ? 'r' : '-';
+        perm[1] = (mode & S_IWUSR) ? 'w' : '-';
+        perm[2] = (mode & S_IXUSR) ? 'x' : '-';
+        perm[3] = (mode & S_IRGRP) ? 'r' : '-';
+        perm[4] = (mode & S_IWGRP) ? 'w' : '-';
+        perm[5] = (mode & S_IXGRP) ? 'x' : '-';
+        perm[6] = (mode & S_IROTH) ? 'r' : '-';
+        perm[7] = (mode & S_IWOTH) ? 'w' : '-';
+        perm[8] = (mode & S_IXOTH) ? 'x' : '-';
+        perm[9] = '\0';
+        // 部分文件系统不在目录项中提供类型
+        if (d_type == DT_UNKNOWN)
+            d_type = IFTODT(mode);
+    }
+    else
+    {
+        memset(&file_stat, 0, sizeof(file_stat));
+    }
+
+    const char *type = d_type == DT_REG ? "-" : d_type == DT_DIR ? "d" : "?";
+
+    char size[32] = "-";
+    if (d_type == DT_REG)
+        snprintf(size, sizeof(size), "%lld", (long long)file_stat.st_size);
+
+    char time_buf[80];
+    struct tm tm_buf;
+    strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", localtime_r(&file_stat.st_mtime, &tm_buf));
+
+    reply(s, "%s%s %5.50s %5.50s %5.30s %10.50s %s\r\n", type, perm,
+          lookup_user_name(s->loop, file_stat.st_uid), lookup_group_name(s->loop, file_stat.st_gid),
+          size, time_buf, name);
+    return d_type;
+}
+
+/**
+ * @brief 向客户端发送当前目录的文件列表
+ * @param s 会话
+ */
+void send_directory_list(struct session *s)
+{
+    // 目录没有变化时直接发送缓存的列表
+    struct dir_cache_entry *e = dir_cache_lookup(s);
+    if (e != NULL && e->listing)
+    {
+        s->listing = e->listing;
+        s->listpos = 0;
+        s->state = STATE_SEND_LIST;
+        return;
+    }
+
+    s->filefd = openat(s->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (s->filefd < 0)
+    {
+        char cwd[BUFFER_SIZE];
+        get_session_cwd(s, cwd, sizeof(cwd));
+        reply(s, "dir: cannot open directory '%s'\r\n", cwd);
+        return;
+    }
+
+    // 列表在套接字可写时分批生成, 大目录也只占用有限的内存
+    s->dents = new char[LIST_CHUNK];
+    s->dentlen = 0;
+    s->dentpos = 0;
+    s->state = STATE_SEND_LIST;
+
+    // 同时保存一份副本, 生成完成时如果目录没有变化就放入缓存
+    if (e != NULL)
+    {
+        s->capture = std::make_shared<std::string>();
+        s->capture_gen = e->generation;
+    }
+}
+
+/**
+ * @brief 目录列表生成完成后放入缓存
+ * @param s 会话
+ */
+void dir_cache_store(struct session *s)
+{
+    struct event_loop *loop = s->loop;
+    drain_dir_cache_events(loop);
+    std::map<int, dir_cache_entry>::iterator it = loop->dir_cache.find(s->dirwd);
+    if (it == loop->dir_cache.end() || it->second.generation != s->capture_gen || it->second.listing)
+        return;
+    it->second.listing = s->capture;
+    dir_cache_charge(loop, &it->second, s->capture->size());
+}
+
+/**
+ * @brief 套接字可写时继续生成并发送目录列表
+ * @param s 会话
+ * @return 成功返回0, 出错返回-1
+ */
+int continue_send_list(struct session *s)
+{
+    // 命中缓存时从内存中的列表分块发送, 只保存了名字的行重新生成
+    if (s->listing)
+    {
+        const std::string &listing = *s->listing;
+        while (s->outbuf.size() - s->outpos < MAX_PENDING_OUTPUT && s->listpos < listing.size())
+        {
+            if (listing[s->listpos] == '\0')
+            {
+                const char *name = listing.c_str() + s->listpos + 2;
+                format_directory_entry(s, name, (unsigned char)listing[s->listpos + 1]);
+                s->listpos += strlen(name) + 3;
+                continue;
+            }
+            size_t n = std::min((size_t)LIST_CHUNK, listing.size() - s->listpos);
+            const char *mark = (const char *)memchr(listing.c_str() + s->listpos, '\0', n);
+            if (mark != NULL)
+                n = mark - (listing.c_str() + s->listpos);
+            s->outbuf.append(listing, s->listpos, n);
+            s->listpos += n;
+        }
+        if (s->listpos == s->listing->size())
+        {
+            finish_transfer(s);
+            reply(s, "END\r\n");
+            log_message(LOG_INFO, "Directory send OK (cached).");
+        }
+        return flush_output(s) < 0 ? -1 : 0;
+    }
+
+    // 发送缓冲区积压到MAX_PENDING_OUTPUT时暂停, 等待下一次可写事件
+    while (s->outbuf.size() - s->outpos < MAX_PENDING_OUTPUT)
+    {
+        if (s->dentpos >= s->dentlen)
+        {
+            // 一次系统调用读取一批目录项
+            ssize_t n = getdents64(s->filefd, s->dents, LIST_CHUNK);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                if (n == 0 && s->capture)
+                    dir_cache_store(s);
+                finish_transfer(s);
+                reply(s, "END\r\n");
+                log_message(LOG_INFO, "Directory send OK.");
+                break;
+            }
+            s->dentlen = n;
+            s->dentpos = 0;
+        }
+
+        struct dirent64 *entry = (struct dirent64 *)(s->dents + s->dentpos);
+        s->dentpos += entry->d_reclen;
+        size_t before = s->outbuf.size();
+        unsigned char type = format_directory_entry(s, entry->d_name, entry->d_type);
+
+        // 单个列表超过缓存上限的一半时不再保存副本
+        if (s->capture)
+        {
+            // 子目录和".."的修改时间、符号链接指向的文件变化时本目录没有inotify事件,
+            // 这些行只保存'\0'、类型和以'\0'结尾的名字, 发送时重新生成
+            if (type == DT_REG)
+            {
+                s->capture->append(s->outbuf, before, std::string::npos);
+            }
+            else
+            {
+                s->capture->push_back('\0');
+                s->capture->push_back((char)entry->d_type);
+                s->capture->append(entry->d_name);
+                s->capture->push_back('\0');
+            }
+            if (s->capture->size() > s->loop->cache_budget / 2)
+                s->capture.reset();
+        }
+    }
+    return flush_output(s) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief 把最后一个已返回的目录项编码为分页游标: 十六进制的"排序键/文件名"
+ * @param e 目录项
+ * @param key 排序方式
+ * @return 游标字符串
+ */
+std::string encode_list_cursor(const list_entry &e, char key)
+{
+    char num[32] = "";
+    if (key == 's')
+        snprintf(num, sizeof(num), "%lld", (long long)e.size);
+    else if (key == 'm')
+        snprintf(num, sizeof(num), "%lld", (long long)e.mtime);
+    std::string raw = std::string(num) + "/" + e.name;
+
+    static const char hex[] = "0123456789abcdef";
+    std::string cursor;
+    for (size_t i = 0; i < raw.size(); i++)
+    {
+        cursor += hex[(unsigned char)raw[i] >> 4];
+        cursor += hex[(unsigned char)raw[i] & 15];
+    }
+    return cursor;
+}
+
+/**
+ * @brief 解码分页游标
+ * @param cursor 游标字符串
+ * @param key 排序方式
+ * @param e 保存解码出的排序键和文件名
+ * @return 成功返回true, 游标格式错误返回false
+ */
+bool decode_list_cursor(const char *cursor, char key, list_entry &e)
+{
+    std::string raw;
+    for (size_t i = 0; cursor[i] != '\0'; i += 2)
+    {
+        unsigned int c;
+        if (cursor[i + 1] == '\0' || sscanf(cursor + i, "%2x", &c) != 1)
+            return false;
+        raw += (char)c;
+    }
+    size_t slash = raw.find('/');
+    if (slash == std::string::npos)
+        return false;
+
+    long long num = atoll(raw.substr(0, slash).c_str());
+    e.name = raw.substr(slash + 1);
+    e.size = key == 's' ? num : 0;
+    e.mtime = key == 'm' ? num : 0;
+    return true;
+}
+
+/**
+ * @brief 向客户端发送机器可读的目录列表, 支持过滤、排序和分页
+ * @param s 会话
+ * @param arg 参数: [通配符] [sort=[-]name|size|mtime] [limit=N] [cursor=C]
+ */
+void send_machine_list(struct session *s, const char *arg)
+{
+    // 解析参数
+    struct list_query *q = new list_query();
+    snprintf(q->pattern, sizeof(q->pattern), "*");
+    q->order.key = 'n';
+    q->order.desc = false;
+    q->limit = 0;
+    q->has_cursor = false;
+    q->scanned = false;
+    q->more = false;
+    const char *cursor = NULL;
+    char args[BUFFER_SIZE];
+    snprintf(args, sizeof(args), "%s", arg);
+    bool ok = true;
+    char *save = NULL;
+    for (char *tok = strtok_r(args, " ", &save); tok != NULL && ok; tok = strtok_r(NULL, " ", &save))
+    {
+        if (strncmp(tok, "sort=", 5) == 0)
+        {
+            const char *key = tok + 5;
+            q->order.desc = *key == '-';
+            if (q->order.desc)
+                key++;
+            if (strcmp(key, "name") == 0 || strcmp(key, "size") == 0 || strcmp(key, "mtime") == 0)
+                q->order.key = *key;
+            else
+                ok = false;
+        }
+        else if (strncmp(tok, "limit=", 6) == 0)
+            ok = sscanf(tok + 6, "%zu", &q->limit) == 1;
+        else if (strncmp(tok, "cursor=", 7) == 0)
+            cursor = tok + 7;
+        else if (strchr(tok, '=') == NULL)
+            snprintf(q->pattern, sizeof(q->pattern), "%s", tok);
+        else
+            ok = false;
+    }
+    if (ok && cursor != NULL)
+    {
+        ok = decode_list_cursor(cursor, q->order.key, q->after);
+        q->has_cursor = true;
+    }
+    if (!ok)
+    {
+        delete q;
+        reply(s, "501 Usage: MLSD [pattern] [sort=[-]name|size|mtime] [limit=N] [cursor=C].\r\n");
+        return;
+    }
+
+    s->filefd = openat(s->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (s->filefd < 0)
+    {
+        delete q;
+        reply(s, "550 Cannot open directory.\r\n");
+        return;
+    }
+
+    // 大目录在多次可写事件中扫描, 不会长时间阻塞同一线程中的其他会话
+    s->query = q;
+    s->dents = new char[LIST_CHUNK];
+    s->dentlen = 0;
+    s->dentpos = 0;
+    s->state = STATE_SEND_MLSD;
+}
+
+/**
+ * @brief 扫描一批目录项. 分页时只保留游标之后最靠前的limit+1项, 用大顶堆淘汰靠后的项, 内存只和页大小有关;
+ *        不分页时直接放入小顶堆. 按文件名排序时不需要文件状态, 只有输出的项才调用fstatat,
+ *        因此翻页的代价主要是getdents64; 按大小或修改时间排序时每一页仍然要fstatat整个目录
+ * @param s 会话
+ * @return 扫描完成或还有目录项返回0, 读取目录出错返回-1
+ */
+int scan_machine_list(struct session *s)
+{
+    struct list_query *q = s->query;
+    ssize_t n;
+    do
+        n = getdents64(s->filefd, s->dents, LIST_CHUNK);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -1;
+    list_order_reverse reverse = {q->order};
+    if (n == 0)
+    {
+        // 多取的一项只用来判断是否还有下一页; 改建为小顶堆只需要线性时间, 排序分摊到每次输出
+        q->more = q->limit > 0 && q->page.size() > q->limit;
+        if (q->more)
+        {
+            std::pop_heap(q->page.begin(), q->page.end(), q->order);
+            q->page.pop_back();
+        }
+        if (q->limit > 0)
+            std::make_heap(q->page.begin(), q->page.end(), reverse);
+        q->scanned = true;
+        return 0;
+    }
+
+    for (ssize_t pos = 0; pos < n;)
+    {
+        struct dirent64 *entry = (struct dirent64 *)(s->dents + pos);
+        pos += entry->d_reclen;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (fnmatch(q->pattern, entry->d_name, FNM_PERIOD) != 0)
+            continue;
+
+        list_entry e;
+        e.name = entry->d_name;
+        e.type = 'o';
+        e.size = 0;
+        e.mtime = 0;
+        e.mode = 0;
+        if (q->order.key != 'n')
+        {
+            struct stat file_stat;
+            if (fstatat(s->filefd, entry->d_name, &file_stat, 0) < 0)
+                continue;
+            e.type = S_ISREG(file_stat.st_mode) ? 'f' : S_ISDIR(file_stat.st_mode) ? 'd' : 'o';
+            e.size = file_stat.st_size;
+            e.mtime = file_stat.st_mtime;
+            e.mode = file_stat.st_mode & 0777;
+        }
+        if (q->has_cursor && !q->order(q->after, e))
+            continue;
+
+        q->page.push_back(e);
+        if (q->limit == 0)
+        {
+            std::push_heap(q->page.begin(), q->page.end(), reverse);
+            continue;
+        }
+        std::push_heap(q->page.begin(), q->page.end(), q->order);
+        if (q->page.size() > q->limit + 1)
+        {
+            std::pop_heap(q->page.begin(), q->page.end(), q->order);
+            q->page.pop_back();
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 套接字可写时继续扫描目录, 或者输出已经排好序的目录项
+ * @param s 会话
+ * @return 成功返回0, 出错返回-1
+ */
+int continue_machine_list(struct session *s)
+{
+    struct list_query *q = s->query;
+
+    // 每次可写事件只读取一批目录项, 读取出错时不能把截断的列表当作完整的列表
+    if (!q->scanned)
+    {
+        if (scan_machine_list(s) < 0)
+        {
+            finish_transfer(s);
+            reply(s, "451 Cannot read directory.\r\n");
+        }
+        return flush_output(s) < 0 ? -1 : 0;
+    }
+
+    // 每输出一项弹出一次堆顶, 大目录的排序不会集中在一次事件中完成
+    list_order_reverse reverse = {q->order};
+    while (s->outbuf.size() - s->outpos < MAX_PENDING_OUTPUT && !q->page.empty())
+    {
+        std::pop_heap(q->page.begin(), q->page.end(), reverse);
+        list_entry e = q->page.back();
+        q->page.pop_back();
+        if (q->order.key == 'n')
+        {
+            struct stat file_stat;
+            if (fstatat(s->filefd, e.name.c_str(), &file_stat, 0) < 0)
+            {
+                q->after = e;
+                continue;
+            }
+            e.type = S_ISREG(file_stat.st_mode) ? 'f' : S_ISDIR(file_stat.st_mode) ? 'd' : 'o';
+            e.size = file_stat.st_size;
+            e.mtime = file_stat.st_mtime;
+            e.mode = file_stat.st_mode & 0777;
+        }
+        char modify[32];
+        struct tm tm_buf;
+        strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", gmtime_r(&e.mtime, &tm_buf));
+        const char *type = e.type == 'f' ? "file" : e.type == 'd' ? "dir" : "other";
+        reply(s, "type=%s;size=%lld;modify=%s;perm=%04o; %s\r\n", type, (long long)e.size, modify, (unsigned int)e.mode, e.name.c_str());
+        q->after = e;
+    }
+
+    // 还有更多目录项时附上下一页的游标
+    if (q->page.empty())
+    {
+        std::string next = q->more ? encode_list_cursor(q->after, q->order.key) : "";
+        finish_transfer(s);
+        if (!next.empty())
+            reply(s, "END %s\r\n", next.c_str());
+        else
+            reply(s, "END\r\n");
+    }
+    return flush_output(s) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief 更改当前工作目录
+ * @param s 会话
+ * @param path 目录路径
+ */
+void change_directory(struct session *s, const char *path)
+{
+    // 只替换本会话的目录描述符, 不影响进程和其他会话的工作目录
+    int fd = openat(s->dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        reply(s, "cd: %s: No such file or directory\r\n", path);
+        return;
+    }
+    close(s->dirfd);
+    s->dirfd = fd;
+    s->dirwd = -1;
+    reply(s, "Directory changed.\r\n");
+}
+
+/**
+ * @brief 向客户端发送当前工作目录的路径
+ * @param s 会话
+ */
+void send_current_directory_path(struct session *s)
+{
+    char cwd[BUFFER_SIZE];
+    get_session_cwd(s, cwd, sizeof(cwd));
+    reply(s, "%s\r\n", cwd);
+}
+
+/**
+ * @brief 向客户端发送系统信息
+ * @param s 会话
+ */
+void send_system_info(struct session *s)
+{
+#ifdef _WIN32
+    OSVERSIONINFO osvi;
+    ZeroMemory(&osvi, sizeof(OSVERSIONINFO));
+    osvi.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
+    GetVersionEx(&osvi);
+    reply(s, "Windows %d.%d.%d\r\n", osvi.dwMajorVersion, osvi.dwMinorVersion, osvi.dwBuildNumber);
+#elif __linux__
+    struct utsname uts;
+    uname(&uts);
+    reply(s, "Linux %s %s\r\n", uts.release, uts.machine);
+#elif __APPLE__
+    char version[256];
+    size_t len = sizeof(version);
+    sysctlbyname("kern.osrelease", &version, &len, NULL, 0);
+    reply(s, "macOS %s\r\n", version);
+#else
+    reply(s, "Unknown\r\n");
+#endif
+}
+
+/**
+ * @brief 向客户端发送“Goodbye.”的消息
+ * @param s 会话
+ */
+void send_goodbye_message(struct session *s)
+{
+    reply(s, "Goodbye.\r\n");
+}
+
+/**
+ * @brief QUIT: 发送告别信息后关闭连接
+ */
+void cmd_quit(struct session *s, char *arg)
+{
+    send_goodbye_message(s);
+    s->state = STATE_CLOSING;
+}
+
+/**
+ * @brief SYST: 发送服务器的系统信息
+ */
+void cmd_syst(struct session *s, char *arg)
+{
+    send_system_info(s);
+}
+
+/**
+ * @brief PWD: 发送当前目录
+ */
+void cmd_pwd(struct session *s, char *arg)
+{
+    send_current_directory_path(s);
+}
+
+/**
+ * @brief CD <目录>: 改变当前目录
+ */
+void cmd_cd(struct session *s, char *arg)
+{
+    change_directory(s, arg);
+}
+
+/**
+ * @brief DIR: 发送当前目录的列表
+ */
+void cmd_dir(struct session *s, char *arg)
+{
+    send_directory_list(s);
+}
+
+/**
+ * @brief HASH <文件名>: 发送文件的CRC32C
+ */
+void cmd_hash(struct session *s, char *arg)
+{
+    send_file_hash(s, arg);
+}
+
+/**
+ * @brief MLSD [参数]: 发送机器可读的目录列表
+ */
+void cmd_mlsd(struct session *s, char *arg)
+{
+    send_machine_list(s, arg);
+}
+
+/**
+ * @brief SIZE <文件名>: 发送文件的大小
+ */
+void cmd_size(struct session *s, char *arg)
+{
+    send_file_size(s, arg);
+}
+
+/**
+ * @brief MODE S 不压缩; MODE Z [级别] 之后的GET/PUT按数据块压缩传输
+ */
+void cmd_mode(struct session *s, char *arg)
+{
+    char mode = '\0';
+    int level = Z_DEFAULT_COMPRESSION;
+    int n = sscanf(arg, " %c %d", &mode, &level);
+    if (n >= 1 && (mode == 'S' || mode == 's'))
+    {
+        s->zlevel = 0;
+        reply(s, "200 Mode set to S.\r\n");
+    }
+    else if (n >= 1 && (mode == 'Z' || mode == 'z') && (level == Z_DEFAULT_COMPRESSION || (level >= 1 && level <= 9)))
+    {
+        s->zlevel = level == Z_DEFAULT_COMPRESSION ? 6 : level;
+        reply(s, "200 Mode set to Z, level %d.\r\n", s->zlevel);
+    }
+    else
+    {
+        reply(s, "501 Usage: MODE S | MODE Z [1-9].\r\n");
+    }
+}
+
+/**
+ * @brief REST <偏移>: 下一次GET从该偏移开始发送, 下一次PUT从该偏移开始写入
+ */
+void cmd_rest(struct session *s, char *arg)
+{
+    long long offset;
+    if (sscanf(arg, "%lld", &offset) != 1 || offset < 0)
+    {
+        reply(s, "501 Usage: REST <offset>.\r\n");
+    }
+    else
+    {
+        s->restart = offset;
+        reply(s, "350 Restarting at %lld.\r\n", offset);
+    }
+}
+
+/**
+ * @brief GET <文件名>: 发送文件
+ */
+void cmd_get(struct session *s, char *arg)
+{
+    send_file(s, arg, s->restart, -1);
+    s->restart = 0;
+}
+
+/**
+ * @brief PART <偏移> <长度> <文件名>: 只发送文件中的一段, 供客户端多连接并行下载
+ */
+void cmd_part(struct session *s, char *arg)
+{
+    long long offset, length;
+    char filename[BUFFER_SIZE];
+    if (sscanf(arg, "%lld %lld %[^\r\n]", &offset, &length, filename) != 3 || offset < 0 || length < 0)
+        reply(s, "501 Usage: PART <offset> <length> <filename>.\r\n");
+    else
+        send_file(s, filename, offset, length);
+    s->restart = 0;
+}
+
+/**
+ * @brief PUT <长度> <文件名>: 命令之后紧跟指定长度的文件数据
+ */
+void cmd_put(struct session *s, char *arg)
+{
+    long long size;
+    char filename[BUFFER_SIZE];
+    if (sscanf(arg, "%lld %[^\r\n]", &size, filename) != 2 || size < 0)
+        reply(s, "501 Usage: PUT <size> <filename>.\r\n");
+    else
+        recv_file(s, filename, s->restart, size, s->zlevel > 0 ? MODE_DEFLATE : MODE_SPLICE);
+    s->restart = 0;
+}
+
+/**
+ * @brief SUMS <块大小> <文件名>: 之后是每个完整块8字节的弱校验和与CRC32C
+ */
+void cmd_sums(struct session *s, char *arg)
+{
+    long long blocksize;
+    char filename[BUFFER_SIZE];
+    if (sscanf(arg, "%lld %[^\r\n]", &blocksize, filename) != 2 || blocksize < MIN_DELTA_BLOCK || blocksize > TRANSFER_CHUNK)
+        reply(s, "501 Usage: SUMS <blocksize> <filename>.\r\n");
+    else
+        send_block_sums(s, filename, blocksize);
+}
+
+/**
+ * @brief DELTA <长度> <块大小> <文件名>: 命令之后是块引用和字面数据组成的数据块, 以长度为0的块结束
+ */
+void cmd_delta(struct session *s, char *arg)
+{
+    long long size, blocksize;
+    char filename[BUFFER_SIZE];
+    if (sscanf(arg, "%lld %lld %[^\r\n]", &size, &blocksize, filename) != 3 || size < 0 ||
+        blocksize < MIN_DELTA_BLOCK || blocksize > TRANSFER_CHUNK)
+        reply(s, "501 Usage: DELTA <size> <blocksize> <filename>.\r\n");
+    else
+        recv_delta_file(s, filename, size, blocksize);
+    s->restart = 0;
+}
+
+/**
+ * @brief 命令处理函数
+ * @param s 会话
+ * @param arg 命令的参数, 没有参数时为空字符串
+ */
+typedef void (*command_handler)(struct session *s, char *arg);
+
+void cmd_stat(struct session *s, char *arg);
+
+/**
+ * @brief 命令表中的一项
+ */
+struct command_entry
+{
+    const char *verb;        // 命令名, 最多8个字符
+    command_handler handler; // 处理函数
+    bool transfer;           // 是否为占用传输名额的GET/PUT类命令
+};
+
+/**
+ * @brief 服务器支持的全部命令
+ */
+static const struct command_entry commands[] = {
+    {"QUIT", cmd_quit, false},
+    {"SYST", cmd_syst, false},
+    {"PWD", cmd_pwd, false},
+    {"CD", cmd_cd, false},
+    {"DIR", cmd_dir, false},
+    {"HASH", cmd_hash, false},
+    {"MLSD", cmd_mlsd, false},
+    {"SIZE", cmd_size, false},
+    {"MODE", cmd_mode, false},
+    {"REST", cmd_rest, false},
+    {"GET", cmd_get, true},
+    {"PART", cmd_part, true},
+    {"PUT", cmd_put, true},
+    {"SUMS", cmd_sums, false},
+    {"DELTA", cmd_delta, true},
+    {"STAT", cmd_stat, false},
+};
+static const size_t command_count = sizeof(commands) / sizeof(commands[0]);
+static_assert(command_count <= MAX_COMMANDS, "too many commands for the statistics table");
+
+/**
+ * @brief 命令名打包成的整数到处理函数的开放寻址散列表, 查找时不需要逐个比较字符串
+ */
+static uint64_t command_keys[COMMAND_SLOTS];
+static const struct command_entry *command_table[COMMAND_SLOTS];
+
+/**
+ * @brief 把命令名打包成一个整数, 忽略大小写
+ * @param verb 命令名
+ * @param len 命令名的长度
+ * @return 打包后的整数, 命令名超过8个字符时返回0
+ */
+uint64_t command_key(const char *verb, size_t len)
+{
+    if (len == 0 || len > 8)
+        return 0;
+    uint64_t key = 0;
+    for (size_t i = 0; i < len; i++)
+        key = (key << 8) | (unsigned char)toupper((unsigned char)verb[i]);
+    return key;
+}
+
+/**
+ * @brief 命令名在散列表中的初始位置
+ * @param key 打包后的命令名
+ * @return 位置
+ */
+static inline size_t command_slot(uint64_t key)
+{
+    return (key * 0x9E3779B97F4A7C15ull) >> (64 - COMMAND_BITS);
+}
+
+/**
+ * @brief 建立命令散列表, 在创建工作线程之前调用
+ */
+void init_command_table()
+{
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        uint64_t key = command_key(commands[i].verb, strlen(commands[i].verb));
+        size_t slot = command_slot(key);
+        while (command_table[slot] != NULL)
+            slot = (slot + 1) % COMMAND_SLOTS;
+        command_keys[slot] = key;
+        command_table[slot] = &commands[i];
+    }
+}
+
+/**
+ * @brief 查找命令
+ * @param verb 命令名
+ * @param len 命令名的长度
+ * @return 命令表中的项, 不支持的命令返回NULL
+ */
+const struct command_entry *find_command(const char *verb, size_t len)
+{
+    uint64_t key = command_key(verb, len);
+    if (key == 0)
+        return NULL;
+    for (size_t slot = command_slot(key); command_table[slot] != NULL; slot = (slot + 1) % COMMAND_SLOTS)
+        if (command_keys[slot] == key)
+            return command_table[slot];
+    return NULL;
+}
+
+/**
+ * @brief 汇总所有工作线程的统计计数. 读取时不加锁, 各个计数之间可能相差正在执行的几次操作
+ * @param total 保存汇总结果
+ */
+void collect_stats(struct loop_stats *total)
+{
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < worker_count; i++)
+    {
+        const struct loop_stats *st = &event_loops[i].stats;
+        total->sessions_opened += stat_read(&st->sessions_opened);
+        total->sessions_closed += stat_read(&st->sessions_closed);
+        total->bytes_sent += stat_read(&st->bytes_sent);
+        total->bytes_received += stat_read(&st->bytes_received);
+        total->invalid_commands += stat_read(&st->invalid_commands);
+        total->sessions_refused += stat_read(&st->sessions_refused);
+        total->transfers_queued += stat_read(&st->transfers_queued);
+        total->transfers_refused += stat_read(&st->transfers_refused);
+        total->sessions_timed_out += stat_read(&st->sessions_timed_out);
+        for (size_t c = 0; c < command_count; c++)
+        {
+            total->commands[c].count += stat_read(&st->commands[c].count);
+            total->commands[c].total_us += stat_read(&st->commands[c].total_us);
+            for (int b = 0; b < STAT_BUCKETS; b++)
+                total->commands[c].buckets[b] += stat_read(&st->commands[c].buckets[b]);
+        }
+    }
+}
+
+/**
+ * @brief 由延迟直方图估计分位数
+ * @param cs 一种命令的统计
+ * @param q 分位点, 例如0.99
+ * @return 分位数所在桶的上界, 单位微秒
+ */
+uint64_t histogram_percentile(const struct command_stats *cs, double q)
+{
+    uint64_t total = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++)
+        total += cs->buckets[b];
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++)
+    {
+        seen += cs->buckets[b];
+        if (seen > rank)
+            return 1ull << b;
+    }
+    return 1ull << (STAT_BUCKETS - 1);
+}
+
+/**
+ * @brief 发送服务器和本会话的统计信息 (STAT)
+ * @param s 会话
+ * @param arg 未使用
+ */
+void cmd_stat(struct session *s, char *arg)
+{
+    struct loop_stats total;
+    collect_stats(&total);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double uptime = elapsed_us(server_start, now) / 1e6;
+    double age = elapsed_us(s->connected, now) / 1e6;
+
+    reply(s, "211-Server status:\r\n");
+    reply(s, " Uptime: %.1f s, workers: %d\r\n", uptime, worker_count);
+    reply(s, " Sessions: %llu active, %llu total\r\n", (unsigned long long)(total.sessions_opened - total.sessions_closed),
+          (unsigned long long)total.sessions_opened);
+    reply(s, " Traffic: %llu bytes sent, %llu bytes received, %.2f MB/s average\r\n", (unsigned long long)total.bytes_sent,
+          (unsigned long long)total.bytes_received, (total.bytes_sent + total.bytes_received) / 1e6 / (uptime > 0 ? uptime : 1));
+    reply(s, " This session: %lu commands, %llu bytes sent, %llu bytes received, %.2f MB/s average\r\n", s->commands_done,
+          s->bytes_sent, s->bytes_received, (s->bytes_sent + s->bytes_received) / 1e6 / (age > 0 ? age : 1));
+    reply(s, " Invalid commands: %llu\r\n", (unsigned long long)total.invalid_commands);
+    reply(s, " Admission: %llu sessions refused, %d transfers active, %d queued, %llu queued total, %llu refused\r\n",
+          (unsigned long long)total.sessions_refused, __atomic_load_n(&active_transfers, __ATOMIC_RELAXED),
+          __atomic_load_n(&queued_transfers, __ATOMIC_RELAXED), (unsigned long long)total.transfers_queued,
+          (unsigned long long)total.transfers_refused);
+    reply(s, " Timeouts: %llu sessions closed (idle %d s, command %d s, transfer %d s)\r\n",
+          (unsigned long long)total.sessions_timed_out, idle_timeout, command_timeout, transfer_timeout);
+
+    // 分位数是直方图桶的上界, 表示"不超过"
+    reply(s, " %-8s %10s %10s %10s %10s %10s\r\n", "Command", "Count", "Avg(us)", "P50(us)", "P99(us)", "P999(us)");
+    for (size_t c = 0; c < command_count; c++)
+    {
+        const struct command_stats *cs = &total.commands[c];
+        if (cs->count == 0)
+            continue;
+        reply(s, " %-8s %10llu %10llu %10llu %10llu %10llu\r\n", commands[c].verb, (unsigned long long)cs->count,
+              (unsigned long long)(cs->total_us / cs->count), (unsigned long long)histogram_percentile(cs, 0.50),
+              (unsigned long long)histogram_percentile(cs, 0.99), (unsigned long long)histogram_percentile(cs, 0.999));
+    }
+    reply(s, "211 End of status.\r\n");
+}
+
+/**
+ * @brief 执行已经通过准入检查的命令
+ * @param s 会话
+ * @param cmd 命令
+ * @param arg 命令的参数
+ */
+void run_command(struct session *s, const struct command_entry *cmd, char *arg)
+{
+    cmd->handler(s, arg);
+    s->refused = false;
+    // 没有开始传输的命令已经执行完毕
+    if (s->state == STATE_COMMAND || s->state == STATE_CLOSING)
+    {
+        release_transfer_slot(s);
+        finish_command(s);
+    }
+}
+
+/**
+ * @brief 解析并执行一条命令
+ * @param s 会话
+ * @param line 以'\0'结尾的命令行
+ */
+void handle_command(struct session *s, char *line)
+{
+    log_message(LOG_DEBUG, "Received data from client: %s", line);
+
+    // 命令名和参数之间用空白分隔, 参数是之后的整行
+    char *verb = line + strspn(line, " \t");
+    size_t len = strcspn(verb, " \t");
+    char *arg = verb + len;
+    arg += strspn(arg, " \t");
+
+    // 上一条命令回到命令状态后还没有计时的, 先结束它
+    finish_command(s);
+    const struct command_entry *cmd = find_command(verb, len);
+    if (cmd == NULL)
+    {
+        stat_add(&s->loop->stats.invalid_commands, 1);
+        reply(s, "Invalid command.\r\n"); // 发送无效命令信息
+        return;
+    }
+
+    s->command = cmd - commands;
+    clock_gettime(CLOCK_MONOTONIC, &s->command_start);
+
+    // 传输名额已满时排队, 本线程已经有传输在排队时也排在它们后面; 队列也满时拒绝这次传输
+    if (cmd->transfer && !s->has_slot)
+    {
+        if (s->loop->queued.empty() && acquire_transfer_slot())
+            s->has_slot = true;
+        else if (queue_transfer(s, cmd, arg))
+            return;
+        else
+        {
+            stat_add(&s->loop->stats.transfers_refused, 1);
+            s->refused = true;
+        }
+    }
+    run_command(s, cmd, arg);
+}
+
+/**
+ * @brief PUT命令之后已经读入输入缓冲区的数据属于文件内容, 交给正在接收的文件
+ * @param s 会话
+ * @return 成功返回0, 出错返回-1
+ */
+int recv_buffered_file_data(struct session *s)
+{
+    if (s->state == STATE_RECV_FILE && s->inpos < s->inlen)
+    {
+        ssize_t n = recv_file_data(s, s->inbuf + s->inpos, s->inlen - s->inpos);
+        if (n < 0)
+            return -1;
+        s->inpos += n;
+        s->inscan = s->inpos;
+    }
+    return 0;
+}
+
+/**
+ * @brief 处理输入缓冲区中所有完整的命令行. 一次读入的数据可以包含任意多条命令,
+ *        一条命令也可以分几次到达; 已经查找过的部分不会重复查找, 已处理的命令只移动读位置
+ * @param s 会话
+ * @return 成功返回0, 出错返回-1
+ */
+int process_commands(struct session *s)
+{
+    while (s->state == STATE_COMMAND && s->outbuf.size() < MAX_PENDING_OUTPUT)
+    {
+        char *start = s->inbuf + s->inpos;
+        char *eol = (char *)memchr(s->inbuf + s->inscan, '\n', s->inlen - s->inscan);
+        if (eol == NULL)
+        {
+            s->inscan = s->inlen;
+            // 一行命令超过了最大长度, 丢弃到下一个换行符为止并报错
+            if (s->inlen - s->inpos >= BUFFER_SIZE)
+            {
+                if (!s->discard)
+                    reply(s, "Invalid command.\r\n");
+                s->discard = true;
+                s->inpos = s->inscan = s->inlen;
+            }
+            break;
+        }
+
+        size_t len = eol - start;
+        s->inpos += len + 1;
+        s->inscan = s->inpos;
+        if (s->discard)
+        {
+            s->discard = false;
+            continue;
+        }
+        if (len >= BUFFER_SIZE)
+        {
+            reply(s, "Invalid command.\r\n");
+            continue;
+        }
+
+        char line[BUFFER_SIZE];
+        memcpy(line, start, len);
+        line[len] = '\0';
+        if (len > 0 && line[len - 1] == '\r')
+            line[len - 1] = '\0';
+        handle_command(s, line);
+        if (recv_buffered_file_data(s) < 0)
+            return -1;
+    }
+    if (s->inpos == s->inlen)
+        s->inpos = s->inscan = s->inlen = 0;
+    return 0;
+}
+
+/**
+ * @brief 套接字可读时的处理
+ * @param s 会话
+ * @return 成功返回0, 需要关闭会话返回-1
+ */
+int on_readable(struct session *s)
+{
+    if (s->state == STATE_RECV_FILE)
+        return continue_recv_file(s);
+    if (s->state != STATE_COMMAND)
+        return 0;
+
+    // 把未处理完的部分移到缓冲区开头, 每次读取最多移动一次
+    if (s->inpos > 0)
+    {
+        memmove(s->inbuf, s->inbuf + s->inpos, s->inlen - s->inpos);
+        s->inlen -= s->inpos;
+        s->inscan -= s->inpos;
+        s->inpos = 0;
+    }
+    if (s->inlen == sizeof(s->inbuf))
+        return 0;
+
+    ssize_t n = recv(s->sockfd, s->inbuf + s->inlen, sizeof(s->inbuf) - s->inlen, 0);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    if (n == 0)
+        return -1;
+    count_received(s, n);
+    s->inlen += n;
+    return process_commands(s);
+}
+
+/**
+ * @brief 套接字可写时的处理
+ * @param s 会话
+ * @return 成功返回0, 需要关闭会话返回-1
+ */
+int on_writable(struct session *s)
+{
+    int ret = flush_output(s);
+    if (ret <= 0)
+        return ret;
 
-#define BUFFER_SIZE 1024
-#define MAX_CLIENTS 3
+    if (s->state == STATE_SEND_FILE)
+        return continue_send_file(s);
+    if (s->state == STATE_SEND_LIST)
+        return continue_send_list(s);
+    if (s->state == STATE_SEND_MLSD)
+        return continue_machine_list(s);
+    if (s->state == STATE_HASH)
+        return continue_file_hash(s);
+    if (s->state == STATE_SEND_SUMS)
+        return continue_send_sums(s);
+    if (s->state == STATE_CLOSING)
+        return -1;
+    return 0;
+}
 
 /**
- * @brief 输出错误信息并退出程序
- * @param msg 错误信息
+ * @brief 描述符用尽时释放预留的描述符接受一个连接, 应答421后立即关闭, 再重新预留.
+ *        否则水平触发的监听套接字一直可读, 事件循环会空转
+ * @param loop 事件循环
+ * @return 拒绝了一个连接返回1, 已经没有等待的连接返回0, 没有预留的描述符或仍然无法接受时返回-1
  */
-void error(const char *msg)
+int shed_connection(struct event_loop *loop)
 {
-    perror(msg);
-    exit(1);
+    if (loop->reservefd < 0)
+        return -1;
+    close(loop->reservefd);
+    int fd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    int ret = fd >= 0 ? 1 : (errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1);
+    if (fd >= 0)
+    {
+        send(fd, OUT_OF_RESOURCES, strlen(OUT_OF_RESOURCES), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(fd);
+        stat_add(&loop->stats.sessions_refused, 1);
+    }
+    loop->reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return ret;
 }
 
 /**
- * @brief 从指定的套接字接收文件数据并保存到指定的文件中
- * @param sockfd 套接字文件描述符
- * @param buffer 缓冲区指针
- * @param filename 要保存的文件名
+ * @brief 暂停接受连接, 直到有会话关闭或定时器重试
+ * @param loop 事件循环
  */
-void recv_file(int sockfd, char *buffer, const char *filename)
+void pause_accepting(struct event_loop *loop)
 {
-    memset(buffer, 0, BUFFER_SIZE);
+    if (loop->accept_paused)
+        return;
+    log_message(LOG_WARN, "Warning: out of file descriptors, pausing accept on worker %d", loop->id);
+    loop->accept_paused = true;
+    loop->paused_at = wheel_tick();
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, loop->listenfd, &ev);
+    update_loop_timer(loop);
+}
 
-    // 创建本地文件
-    FILE *outfile = fopen(filename, "wb");
-    if (outfile == NULL)
-    {
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "550 Failed to create file.\r\n");
-        send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+/**
+ * @brief 恢复接受连接, 并补上预留的描述符
+ * @param loop 事件循环
+ */
+void resume_accepting(struct event_loop *loop)
+{
+    if (!loop->accept_paused)
         return;
-    }
+    loop->accept_paused = false;
+    if (loop->reservefd < 0)
+        loop->reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, loop->listenfd, &ev);
+}
 
-    // 接收文件数据
-    int n;
-    while (true)
+/**
+ * @brief 关闭会话并释放其资源
+ * @param s 会话
+ */
+void close_session(struct session *s)
+{
+    log_message(LOG_INFO, "Client disconnected. IP address: %s, port: %d", s->client_ip, ntohs(s->client_addr.sin_port));
+    stat_add(&s->loop->stats.sessions_closed, 1);
+    if (s->throttled)
+        s->loop->throttled.erase(s->throttle_pos);
+    wheel_del(&s->loop->wheel, &s->deadline);
+    if (s->state == STATE_QUEUED)
     {
-        // 使用select函数等待socket变为可读
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(sockfd, &read_fds);
-
-        // 设置超时时间为1秒
-        struct timeval timeout = {1, 0};
-        int ret = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
-        if (ret == -1)
-            error("Error: select function failed");
-        else if (ret == 0)
-            error("Timeout");
-        else
-        {
-            // socket变为可读，使用recv函数接收数据
-            n = recv(sockfd, buffer, BUFFER_SIZE, 0);
-            if (n == -1)
-                error("Error receiving message from client");
-            else if (n == 0)
-                error("FTP client closed connection");
-            else
-            {
-                // 接收到了数据
-                if (strstr(buffer, "EOF") != NULL)
-                {
-                    char *p = strstr(buffer, "EOF");
-                    fwrite(buffer, sizeof(char), p - buffer, outfile);
-                    break;
-                }
-                fwrite(buffer, sizeof(char), n, outfile);
-            }
-        }
+        s->loop->queued.erase(s->queue_pos);
+        __atomic_sub_fetch(&queued_transfers, 1, __ATOMIC_RELAXED);
     }
+    release_transfer_slot(s);
+    release_connection(s->ip, s->client_addr);
+    if (s->filefd >= 0)
+        close(s->filefd);
+    if (s->basefd >= 0)
+        close(s->basefd);
+    close(s->dirfd);
+    delete[] s->dents;
+    delete s->query;
+    if (s->pipefd[0] >= 0)
+    {
+        close(s->pipefd[0]);
+        close(s->pipefd[1]);
+    }
+    epoll_ctl(s->loop->epfd, EPOLL_CTL_DEL, s->sockfd, NULL);
+    close(s->sockfd);
+    resume_accepting(s->loop);
+    delete s;
+}
 
-    fclose(outfile);
-
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "226 Transfer complete.\r\n");
-    send(sockfd, buffer, strlen(buffer), 0);
+/**
+ * @brief 处理会话上的就绪事件
+ * @param s 会话
+ * @param events epoll返回的事件
+ */
+void handle_session_event(struct session *s, uint32_t events)
+{
+    int ret = 0;
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN))
+        ret = -1;
+    if (ret == 0 && (events & EPOLLIN))
+        ret = on_readable(s);
+    if (ret == 0)
+        ret = on_writable(s);
+    if (ret == 0 && s->state == STATE_COMMAND)
+    {
+        // 发送缓冲区清空后继续处理暂停的命令
+        ret = process_commands(s);
+        if (ret == 0)
+            ret = on_writable(s);
+    }
+    if (ret == 0 && s->state == STATE_COMMAND)
+        finish_command(s);
 
-    // 输出文件传输完成信息
-    printf("File transfer complete.\r\n");
+    if (ret < 0)
+        close_session(s);
+    else
+        update_events(s);
 }
 
 /**
- * @brief 从指定的套接字发送指定文件的内容
- * @param sockfd 套接字文件描述符
- * @param buffer 缓冲区指针
- * @param filename 要发送的文件名
+ * @brief 为新接受的连接创建会话并发送欢迎信息
+ * @param loop 事件循环
+ * @param new_sockfd 连接的套接字描述符
+ * @param client_addr 客户端地址
  */
-void send_file(int sockfd, char *buffer, const char *filename)
+void add_session(struct event_loop *loop, int new_sockfd, const struct sockaddr_in &client_addr)
 {
-    memset(buffer, 0, BUFFER_SIZE);
+    // 应答已经在发送缓冲区中合并, 关闭Nagle算法, 避免应答之后的小文件等待对端的延迟确认
+    int opt = 1;
+    setsockopt(new_sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
 
-    // 打开本地文件
-    FILE *infile = fopen(filename, "rb");
-    if (infile == NULL)
+    // 超过连接数上限时直接应答421并关闭, 不创建会话
+    struct ip_bucket *ip;
+    const char *refusal = admit_connection(client_addr, &ip);
+    if (refusal != NULL)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "550 Failed to open file.\r\n");
-        send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+        send(new_sockfd, refusal, strlen(refusal), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(new_sockfd);
+        stat_add(&loop->stats.sessions_refused, 1);
+        log_message(LOG_WARN, "Connection refused: %.*s", (int)strlen(refusal) - 2, refusal);
         return;
     }
 
-    // 发送文件数据
-    int n;
-    while ((n = fread(buffer, sizeof(char), BUFFER_SIZE, infile)) > 0)
-        send(sockfd, buffer, n, 0);
+    struct session *s = new session();
+    s->loop = loop;
+    s->sockfd = new_sockfd;
+    s->client_addr = client_addr;
+    inet_ntop(AF_INET, &client_addr.sin_addr, s->client_ip, sizeof(s->client_ip));
+    s->state = STATE_COMMAND;
+    s->events = EPOLLIN;
+    s->inpos = 0;
+    s->inlen = 0;
+    s->inscan = 0;
+    s->discard = false;
+    s->outpos = 0;
+    s->filefd = -1;
+    s->filestart = 0;
+    s->filepos = 0;
+    s->filesize = 0;
+    s->mode = MODE_SENDFILE;
+    s->status = 0;
+    s->restart = 0;
+    s->synced = 0;
+    s->zlevel = 0;
+    s->zstored = 0;
+    s->basefd = -1;
+    s->blocksize = 0;
+    s->pipefd[0] = s->pipefd[1] = -1;
+    s->pipelen = 0;
+    s->dents = NULL;
+    s->dentlen = 0;
+    s->dentpos = 0;
+    s->dirwd = -1;
+    s->listpos = 0;
+    s->capture_gen = 0;
+    s->query = NULL;
+    s->command = -1;
+    s->commands_done = 0;
+    s->bytes_sent = 0;
+    s->bytes_received = 0;
+    clock_gettime(CLOCK_MONOTONIC, &s->connected);
+    bucket_init(&s->bucket, session_rate);
+    s->ip = ip; // 同一IP的会话共享一个令牌桶
+    s->throttled = false;
+    s->has_slot = false;
+    s->refused = false;
+    s->queued_cmd = NULL;
+    s->deadline.prev = s->deadline.next = NULL;
+    s->deadline.data = s;
 
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "EOF\r\n");
-    send(sockfd, buffer, strlen(buffer), 0);
-
-    fclose(infile);
+    // 每个会话从服务器的启动目录开始, 之后的CD只改变自己的目录描述符
+    s->dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (s->dirfd < 0)
+    {
+        log_message(LOG_ERROR, "Error: cannot open working directory: %s", strerror(errno));
+        send(new_sockfd, OUT_OF_RESOURCES, strlen(OUT_OF_RESOURCES), MSG_NOSIGNAL | MSG_DONTWAIT);
+        release_connection(ip, client_addr);
+        close(new_sockfd);
+        delete s;
+        return;
+    }
 
-    // 输出文件传输完成信息
-    printf("File transfer complete.\r\n");
-}
+    log_message(LOG_INFO, "Client connected. IP address: %s, port: %d, worker: %d", s->client_ip, ntohs(client_addr.sin_port), loop->id);
 
-/**
- * @brief 向客户端发送指定文件的大小信息
- * @param sockfd 套接字文件描述符
- * @param buffer 缓冲区指针
- * @param filename 要计算大小的文件名
- */
-void send_file_size(int sockfd, char *buffer, const char *filename)
-{
-    std::ifstream infile(filename, std::ios::in | std::ios::binary);
-    if (!infile)
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = s->events;
+    ev.data.ptr = s;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, new_sockfd, &ev) < 0)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "550 Failed to open file.\r\n");
-        send(sockfd, buffer, strlen(buffer), 0);
+        log_message(LOG_ERROR, "Error: cannot register client connection: %s", strerror(errno));
+        release_connection(ip, client_addr);
+        close(s->dirfd);
+        close(new_sockfd);
+        delete s;
+        return;
     }
-    else
-    {
-        infile.seekg(0, std::ios::end);
-        int size = infile.tellg();
-        infile.close();
+    stat_add(&loop->stats.sessions_opened, 1);
 
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "%d bytes.\r\n", size);
-        send(sockfd, buffer, strlen(buffer), 0);
+    // 时间轮空着时定时器已经停止, 它的刻度可能落后, 直接跳到当前刻度
+    if (deadline_recheck > 0)
+    {
+        if (loop->wheel.count == 0)
+            loop->wheel.now = wheel_tick();
+        s->active = loop->wheel.now;
+        wheel_add(&loop->wheel, &s->deadline, s->active + deadline_recheck);
+        update_loop_timer(loop);
     }
+
+    // 发送欢迎信息
+    reply(s, "Welcome to ftp server!\r\n");
+    handle_session_event(s, 0);
 }
 
 /**
- * @brief 从指定的套接字发送指定目录的文件列表
- * @param sockfd 套接字文件描述符
- * @param buffer 缓冲区指针
+ * @brief 接受监听套接字上所有等待的连接
+ * @param loop 事件循环
  */
-void send_directory_list(int sockfd, char *buffer)
+void accept_clients(struct event_loop *loop)
 {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
-    char cwd[BUFFER_SIZE];
-    char time_buf[80];
-    memset(cwd, 0, BUFFER_SIZE);
-    getcwd(cwd, BUFFER_SIZE);
-    dir = opendir(cwd);
-    if (dir == NULL)
-    {
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "dir: cannot open directory '%s'\r\n", cwd);
-        send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
-    }
-    else
+    while (true)
     {
-        while ((entry = readdir(dir)) != NULL)
+        // 接受客户端的连接请求
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int new_sockfd = accept4(loop->listenfd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_sockfd < 0)
         {
-            char type[10] = "";
-            if (entry->d_type == DT_REG)
-                strcpy(type, "-");
-            else if (entry->d_type == DT_DIR)
-                strcpy(type, "d");
-            else
-                strcpy(type, "?");
-
-            char perm[10] = "";
-            if (stat(entry->d_name, &file_stat) == 0)
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE)
             {
-                mode_t mode = file_stat.st_mode;
-                perm[0] = (mode & S_IRUSR) ? 'r' : '-';
-                perm[1] = (mode & S_IWUSR) ? 'w' : '-';
-                perm[2] = (mode & S_IXUSR) ? 'x' : '-';
-                perm[3] = (mode & S_IRGRP) ? 'r' : '-';
-                perm[4] = (mode & S_IWGRP) ? 'w' : '-';
-                perm[5] = (mode & S_IXGRP) ? 'x' : '-';
-                perm[6] = (mode & S_IROTH) ? 'r' : '-';
-                perm[7] = (mode & S_IWOTH) ? 'w' : '-';
-                perm[8] = (mode & S_IXOTH) ? 'x' : '-';
-                perm[9] = '\0';
+                int shed = shed_connection(loop);
+                if (shed > 0)
+                    continue;
+                if (shed < 0)
+                    pause_accepting(loop);
+                return;
             }
-
-            char owner[32] = "";
-            char group[32] = "";
-            if (getpwuid(file_stat.st_uid) != NULL)
-                strcpy(owner, getpwuid(file_stat.st_uid)->pw_name);
-            if (getgrgid(file_stat.st_gid) != NULL)
-                strcpy(group, getgrgid(file_stat.st_gid)->gr_name);
-
-            char size[16] = "";
-            if (entry->d_type == DT_REG)
-                sprintf(size, "%ld", file_stat.st_size);
-            else
-                strcpy(size, "-");
-
-            strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", localtime(&file_stat.st_mtime));
-
-            memset(buffer, 0, BUFFER_SIZE);
-            sprintf(buffer, "%s%s %5.50s %5.50s %5.30s %10.50s %s\r\n", type, perm, owner, group, size, time_buf, entry->d_name);
-            send(sockfd, buffer, strlen(buffer), 0);
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_message(LOG_ERROR, "Error: cannot accept client connection: %s", strerror(errno));
+            return;
         }
 
-        closedir(dir);
-
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "END\r\n");
-        send(sockfd, buffer, strlen(buffer), 0);
+        add_session(loop, new_sockfd, client_addr);
+    }
+}
 
-        printf("Directory send OK.\n");
+/**
+ * @brief 会话在当前状态下允许多长时间没有收发数据. 排队、计算校验和或等待令牌时由服务器一方决定进度, 不计超时
+ * @param s 会话
+ * @param kind 保存超时的种类, 用于日志
+ * @return 超时的刻度数, 为0表示不检查
+ */
+uint64_t session_timeout(struct session *s, const char **kind)
+{
+    const uint64_t ticks_per_second = 1000 / WHEEL_TICK_MS;
+    if (s->throttled)
+        return 0;
+    switch (s->state)
+    {
+    case STATE_QUEUED:
+    case STATE_HASH:
+        return 0;
+    case STATE_SEND_FILE:
+    case STATE_RECV_FILE:
+        *kind = "transfer";
+        return transfer_timeout * ticks_per_second;
+    case STATE_COMMAND:
+        // 没有未完成的命令行和未发出的应答时, 会话在等待客户端的下一条命令
+        if (s->inpos == s->inlen && s->outpos == s->outbuf.size())
+        {
+            *kind = "idle";
+            return idle_timeout * ticks_per_second;
+        }
+        // fall through
+    default:
+        *kind = "command";
+        return command_timeout * ticks_per_second;
     }
 }
 
 /**
- * @brief 更改当前工作目录
- * @param sockfd 套接字描述符
- * @param buffer 缓冲区指针
- * @param path 目录路径
+ * @brief 会话的超时定时器到期. 定时器只在到期时才检查会话最后一次收发数据的刻度, 收发数据本身只记录刻度,
+ *        不移动定时器; 仍未超时的会话重新加入时间轮, 最迟deadline_recheck个刻度后再检查,
+ *        所以状态改变后换成较短的超时也能及时生效. 超时只关闭这一个会话
+ * @param t 会话的定时器
  */
-void change_directory(int sockfd, char *buffer, const char *path)
+void expire_session(struct wheel_timer *t)
 {
-    if (chdir(path) < 0)
+    struct session *s = (struct session *)t->data;
+    struct timer_wheel *w = &s->loop->wheel;
+    const char *kind = NULL;
+    uint64_t limit = session_timeout(s, &kind);
+    if (limit == 0 || s->active + limit > w->now)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "cd: %s: No such file or directory\r\n", path);
-        send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+        uint64_t next = w->now + deadline_recheck;
+        if (limit > 0)
+            next = std::min(next, s->active + limit);
+        wheel_add(w, t, next);
+        return;
     }
-    else
+
+    log_message(LOG_INFO, "Client timed out (%s). IP address: %s, port: %d", kind, s->client_ip, ntohs(s->client_addr.sin_port));
+    stat_add(&s->loop->stats.sessions_timed_out, 1);
+    // 命令状态下应答421后关闭; 传输中的数据流里不能再插入应答
+    if (s->state == STATE_COMMAND && s->outpos == s->outbuf.size())
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        sprintf(buffer, "Directory changed.\r\n");
-        send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+        const char *msg = "421 Timeout, closing control connection.\r\n";
+        send(s->sockfd, msg, strlen(msg), MSG_NOSIGNAL | MSG_DONTWAIT);
     }
+    close_session(s);
 }
 
 /**
- * @brief 向客户端发送当前工作目录的路径
- * @param sockfd 套接字描述符
- * @param buffer 缓冲区指针
+ * @brief 排队的传输得到名额后执行它的命令, 然后继续处理会话中后面的命令
+ * @param s 会话
  */
-void send_current_directory_path(int sockfd, char *buffer)
+void start_queued_transfer(struct session *s)
 {
-    char cwd[BUFFER_SIZE];
-    memset(cwd, 0, BUFFER_SIZE);
-    getcwd(cwd, BUFFER_SIZE);
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "%s\r\n", cwd);
-    send(sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+    std::string arg;
+    arg.swap(s->queued_arg);
+    s->state = STATE_COMMAND;
+    s->has_slot = true;
+    s->active = s->loop->wheel.now; // 排队的时间不算作传输停滞
+    run_command(s, s->queued_cmd, &arg[0]);
+    if (recv_buffered_file_data(s) < 0)
+        close_session(s);
+    else
+        handle_session_event(s, 0);
 }
 
 /**
- * @brief 从指定的套接字发送系统信息
- * @param sockfd 套接字文件描述符
- * @param buffer 缓冲区指针
+ * @brief 按先来先服务的顺序启动本线程排队的传输, 直到名额用完
+ * @param loop 事件循环
  */
-void send_system_info(int sockfd, char *buffer)
+void admit_queued(struct event_loop *loop)
 {
-    memset(buffer, 0, BUFFER_SIZE);
-
-#ifdef _WIN32
-    OSVERSIONINFO osvi;
-    ZeroMemory(&osvi, sizeof(OSVERSIONINFO));
-    osvi.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
-    GetVersionEx(&osvi);
-    sprintf(buffer, "Windows %d.%d.%d\r\n", osvi.dwMajorVersion, osvi.dwMinorVersion, osvi.dwBuildNumber);
-#elif __linux__
-    struct utsname uts;
-    uname(&uts);
-    sprintf(buffer, "Linux %s %s\r\n", uts.release, uts.machine);
-#elif __APPLE__
-    char version[256];
-    size_t len = sizeof(version);
-    sysctlbyname("kern.osrelease", &version, &len, NULL, 0);
-    sprintf(buffer, "macOS %s\r\n", version);
-#else
-    sprintf(buffer, "Unknown\r\n");
-#endif
-
-    send(sockfd, buffer, strlen(buffer), 0);
+    while (!loop->queued.empty() && acquire_transfer_slot())
+    {
+        struct session *s = loop->queued.front();
+        loop->queued.pop_front();
+        __atomic_sub_fetch(&queued_transfers, 1, __ATOMIC_RELAXED);
+        start_queued_transfer(s);
+    }
 }
 
 /**
- * @brief 向客户端发送“Goodbye.”的消息
- * @param sockfd 套接字描述符
- * @param buffer 缓冲区指针
+ * @brief 定时器触发时按排队顺序恢复等待令牌的会话. 仍然没有令牌的会话重新排到队尾,
+ *        所以同一线程中的大传输轮流前进, 每轮各自最多收发一个SHAPER_QUANTUM.
+ *        其他线程释放的传输名额也在这里分给本线程排队的传输
+ * @param loop 事件循环
  */
-void send_goodbye_message(int sockfd, char *buffer)
+void on_loop_timer(struct event_loop *loop)
 {
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "Goodbye.\r\n");
-    send(sockfd, buffer, strlen(buffer), 0);
+    uint64_t expirations;
+    if (read(loop->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        log_message(LOG_WARN, "Warning: cannot read timer: %s", strerror(errno));
+
+    std::list<struct session *> ready;
+    ready.swap(loop->throttled);
+    for (struct session *s : ready)
+    {
+        s->throttled = false;
+        handle_session_event(s, EPOLLIN);
+    }
+    admit_queued(loop);
+    // 描述符可能由其他线程的会话释放, 每个时间轮刻度重试一次
+    if (loop->accept_paused && wheel_tick() > loop->paused_at)
+        resume_accepting(loop);
+    if (deadline_recheck > 0)
+        wheel_advance(&loop->wheel, wheel_tick(), expire_session);
+    update_loop_timer(loop);
 }
 
 /**
- * @brief 处理与客户端的通信
- * @param sockfd 套接字描述符
- * @param client_addr 客户端地址
+ * @brief 运行事件循环, 分发监听套接字和各个会话上的就绪事件
+ * @param loop 事件循环
  */
-void handle_client(int new_sockfd, struct sockaddr_in client_addr)
+void run_event_loop(struct event_loop *loop)
 {
-    // 处理与客户端的通信
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, BUFFER_SIZE);
-    sprintf(buffer, "Welcome to ftp server!\r\n");
-    send(new_sockfd, buffer, strlen(buffer), 0);
-
+    struct epoll_event events[MAX_EVENTS];
     while (true)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        int n = recv(new_sockfd, buffer, BUFFER_SIZE - 1, 0);
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
         if (n < 0)
-            error("Error: cannot receive data from client");
-        else if (n == 0)
         {
-            printf("Client disconnected. IP address: %s, port: %d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            break;
+            if (errno == EINTR)
+                continue;
+            error("Error: epoll_wait failed");
         }
 
-        printf("Received data from client: %s", buffer);
-
-        // 解析命令和参数
-        char cmd[5];
-        char arg[BUFFER_SIZE];
-        memset(cmd, 0, 5);
-        memset(arg, 0, BUFFER_SIZE);
-        sscanf(buffer, "%4s %[^\r\n]", cmd, arg);
-
-        // 处理命令
-        if (strcmp(cmd, "QUIT") == 0)
-        {
-            send_goodbye_message(new_sockfd, buffer);
-            break;
-        }
-        else if (strcmp(cmd, "SYST") == 0)
-        {
-            send_system_info(new_sockfd, buffer);
-        }
-        else if (strcmp(cmd, "PWD") == 0)
-        {
-            send_current_directory_path(new_sockfd, buffer);
-        }
-        else if (strcmp(cmd, "CD") == 0)
-        {
-            change_directory(new_sockfd, buffer, arg);
-        }
-        else if (strcmp(cmd, "DIR") == 0)
-        {
-            send_directory_list(new_sockfd, buffer);
-        }
-        else if (strcmp(cmd, "SIZE") == 0)
-        {
-            send_file_size(new_sockfd, buffer, arg);
-        }
-        else if (strcmp(cmd, "GET") == 0)
-        {
-            send_file(new_sockfd, buffer, arg);
-        }
-        else if (strcmp(cmd, "PUT") == 0)
-        {
-            recv_file(new_sockfd, buffer, arg);
-        }
-        else
+        for (int i = 0; i < n; i++)
         {
-            // 发送无效命令信息
-            memset(buffer, 0, BUFFER_SIZE);
-            sprintf(buffer, "Invalid command.\r\n");
-            send(new_sockfd, buffer, strlen(buffer), MSG_NOSIGNAL);
+            if (events[i].data.ptr == NULL)
+                accept_clients(loop);
+            else if (events[i].data.ptr == loop)
+                drain_dir_cache_events(loop);
+            else if (events[i].data.ptr == &loop->timerfd)
+                on_loop_timer(loop);
+            else
+                handle_session_event((struct session *)events[i].data.ptr, events[i].events);
         }
+        // 这一轮结束的传输释放的名额立即交给排队的传输
+        if (!loop->queued.empty())
+            admit_queued(loop);
     }
-
-    // 关闭socket
-    close(new_sockfd);
 }
 
 /**
- * @brief 启动FTP服务器，监听指定端口号，并处理客户端连接请求
+ * @brief 创建监听指定端口号的套接字, 每个工作线程各自调用一次
  * @param port 服务器要监听的端口号
  * @return 返回创建的套接字文件描述符
  */
 int start_server(int port)
 {
     // 创建套接字
-    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
     if (sockfd < 0)
         error("Error: cannot create socket");
 
+    // SO_REUSEPORT让每个工作线程绑定同一端口, 由内核在各监听套接字之间分配新连接
+    int opt = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        error("Error: cannot set SO_REUSEPORT");
+
     // 设置服务器的地址和端口号
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
@@ -420,42 +3929,435 @@ int start_server(int port)
         error("Error: cannot bind socket to port");
 
     // 设置socket为监听状态
-    if (listen(sockfd, MAX_CLIENTS) < 0)
+    if (listen(sockfd, LISTEN_BACKLOG) < 0)
         error("Error: cannot listen on socket");
 
-    printf("Server started. Listening on port %d...\n", port);
+    return sockfd;
+}
+
+/**
+ * @brief 初始化工作线程的事件循环: 创建监听套接字和epoll实例
+ * @param loop 事件循环
+ */
+void init_event_loop(struct event_loop *loop)
+{
+    loop->listenfd = start_server(loop->port);
+    memset(&loop->stats, 0, sizeof(loop->stats));
+    loop->reservefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    loop->accept_paused = false;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+        error("Error: cannot create epoll instance");
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) < 0)
+        error("Error: cannot register listening socket");
+
+    // 限速和传输排队的定时器, 有会话等待令牌或传输名额时才启动
+    loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timerfd < 0)
+        error("Error: cannot create timer");
+    loop->timer_ms = 0;
+    wheel_init(&loop->wheel, wheel_tick());
+    ev.data.ptr = &loop->timerfd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0)
+        error("Error: cannot register timer");
+
+    // 目录缓存的失效事件也在本线程中处理, 无法使用inotify时关闭缓存
+    loop->inotifyfd = -1;
+    loop->cache_bytes = 0;
+    if (loop->cache_budget == 0)
+        return;
+    loop->inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (loop->inotifyfd < 0)
+    {
+        perror("Warning: directory cache disabled");
+        return;
+    }
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->inotifyfd, &ev) < 0)
+        error("Error: cannot register inotify descriptor");
+}
+
+/**
+ * @brief 工作线程入口, 把线程绑定到指定CPU后运行事件循环
+ * @param arg 事件循环指针
+ */
+void *worker_main(void *arg)
+{
+    struct event_loop *loop = (struct event_loop *)arg;
+
+    if (loop->cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            fprintf(stderr, "Warning: cannot pin worker %d to CPU %d\n", loop->id, loop->cpu);
+    }
+
+    run_event_loop(loop);
+    return NULL;
+}
+
+/**
+ * @brief 将格式化的文本追加到字符串末尾
+ * @param out 字符串
+ * @param fmt 格式字符串
+ */
+void append_format(std::string &out, const char *fmt, ...)
+{
+    char buffer[BUFFER_SIZE];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out.append(buffer, std::min(n, (int)sizeof(buffer) - 1));
+}
+
+/**
+ * @brief 按Prometheus文本格式输出所有工作线程汇总的统计
+ * @param out 保存输出的文本
+ */
+void format_metrics(std::string &out)
+{
+    struct loop_stats total;
+    collect_stats(&total);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    append_format(out, "# HELP ftp_uptime_seconds Time since the server started.\n# TYPE ftp_uptime_seconds gauge\n");
+    append_format(out, "ftp_uptime_seconds %.3f\n", elapsed_us(server_start, now) / 1e6);
+    append_format(out, "# HELP ftp_sessions_active Connected client sessions.\n# TYPE ftp_sessions_active gauge\n");
+    append_format(out, "ftp_sessions_active %llu\n", (unsigned long long)(total.sessions_opened - total.sessions_closed));
+    append_format(out, "# HELP ftp_sessions_total Accepted client sessions.\n# TYPE ftp_sessions_total counter\n");
+    append_format(out, "ftp_sessions_total %llu\n", (unsigned long long)total.sessions_opened);
+    append_format(out, "# HELP ftp_sent_bytes_total Bytes sent to clients.\n# TYPE ftp_sent_bytes_total counter\n");
+    append_format(out, "ftp_sent_bytes_total %llu\n", (unsigned long long)total.bytes_sent);
+    append_format(out, "# HELP ftp_received_bytes_total Bytes received from clients.\n# TYPE ftp_received_bytes_total counter\n");
+    append_format(out, "ftp_received_bytes_total %llu\n", (unsigned long long)total.bytes_received);
+    append_format(out, "# HELP ftp_invalid_commands_total Unrecognized commands.\n# TYPE ftp_invalid_commands_total counter\n");
+    append_format(out, "ftp_invalid_commands_total %llu\n", (unsigned long long)total.invalid_commands);
+    append_format(out, "# HELP ftp_sessions_refused_total Connections refused by the session limits.\n# TYPE ftp_sessions_refused_total counter\n");
+    append_format(out, "ftp_sessions_refused_total %llu\n", (unsigned long long)total.sessions_refused);
+    append_format(out, "# HELP ftp_transfers_active Transfers holding a transfer slot.\n# TYPE ftp_transfers_active gauge\n");
+    append_format(out, "ftp_transfers_active %d\n", __atomic_load_n(&active_transfers, __ATOMIC_RELAXED));
+    append_format(out, "# HELP ftp_transfers_queued Transfers waiting for a transfer slot.\n# TYPE ftp_transfers_queued gauge\n");
+    append_format(out, "ftp_transfers_queued %d\n", __atomic_load_n(&queued_transfers, __ATOMIC_RELAXED));
+    append_format(out, "# HELP ftp_transfers_queued_total Transfers that had to wait for a slot.\n# TYPE ftp_transfers_queued_total counter\n");
+    append_format(out, "ftp_transfers_queued_total %llu\n", (unsigned long long)total.transfers_queued);
+    append_format(out, "# HELP ftp_transfers_refused_total Transfers refused because the queue was full.\n# TYPE ftp_transfers_refused_total counter\n");
+    append_format(out, "ftp_transfers_refused_total %llu\n", (unsigned long long)total.transfers_refused);
+    append_format(out, "# HELP ftp_sessions_timed_out_total Sessions closed by the idle, command or transfer timeout.\n# TYPE ftp_sessions_timed_out_total counter\n");
+    append_format(out, "ftp_sessions_timed_out_total %llu\n", (unsigned long long)total.sessions_timed_out);
+
+    append_format(out, "# HELP ftp_command_duration_seconds Time from receiving a command to finishing it, including the transfer.\n");
+    append_format(out, "# TYPE ftp_command_duration_seconds histogram\n");
+    for (size_t c = 0; c < command_count; c++)
+    {
+        const struct command_stats *cs = &total.commands[c];
+        uint64_t cumulative = 0;
+        for (int b = 0; b < STAT_BUCKETS - 1; b++)
+        {
+            cumulative += cs->buckets[b];
+            append_format(out, "ftp_command_duration_seconds_bucket{command=\"%s\",le=\"%.6f\"} %llu\n", commands[c].verb,
+                          (double)(1ull << b) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += cs->buckets[STAT_BUCKETS - 1];
+        append_format(out, "ftp_command_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n", commands[c].verb,
+                      (unsigned long long)cumulative);
+        append_format(out, "ftp_command_duration_seconds_sum{command=\"%s\"} %.6f\n", commands[c].verb, cs->total_us / 1e6);
+        append_format(out, "ftp_command_duration_seconds_count{command=\"%s\"} %llu\n", commands[c].verb, (unsigned long long)cumulative);
+    }
+}
+
+/**
+ * @brief 指标端点线程: 依次接受本机的HTTP请求, 每个请求都返回Prometheus格式的统计.
+ *        请求很少, 阻塞处理即可, 不占用工作线程
+ * @param arg 监听套接字描述符
+ */
+void *metrics_main(void *arg)
+{
+    int listenfd = (int)(intptr_t)arg;
+    while (true)
+    {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                log_message(LOG_ERROR, "Error: cannot accept metrics connection: %s", strerror(errno));
+            continue;
+        }
+
+        // 读到请求头结束再应答, 不读完就关闭连接可能会让对端收到RST而丢失应答
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[METRICS_REQUEST];
+        size_t len = 0;
+        while (len < sizeof(request) - 1)
+        {
+            ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+            if (n <= 0)
+                break;
+            len += n;
+            request[len] = '\0';
+            if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+                break;
+        }
+
+        std::string body;
+        format_metrics(body);
+        std::string response;
+        append_format(response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                      body.size());
+        response += body;
+        for (size_t pos = 0; pos < response.size();)
+        {
+            ssize_t n = send(fd, response.data() + pos, response.size() - pos, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            pos += n;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief 在本机回环地址上创建指标端点的监听套接字
+ * @param port 端口号
+ * @return 返回创建的套接字文件描述符
+ */
+int start_metrics(int port)
+{
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sockfd < 0)
+        error("Error: cannot create metrics socket");
+    int opt = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
+    // 指标只对本机开放
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        error("Error: cannot bind metrics port");
+    if (listen(sockfd, LISTEN_BACKLOG) < 0)
+        error("Error: cannot listen on metrics port");
     return sockfd;
 }
 
+/**
+ * @brief 把"512k"、"10m"这样的速率转换为每秒字节数
+ * @param text 速率的文本
+ * @return 每秒字节数, 格式错误时退出程序
+ */
+double parse_rate(const char *text)
+{
+    char *end;
+    double rate = strtod(text, &end);
+    if (*end == 'k' || *end == 'K')
+        rate *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+        rate *= 1024 * 1024, end++;
+    else if (*end == 'g' || *end == 'G')
+        rate *= 1024 * 1024 * 1024, end++;
+    if (end == text || *end != '\0' || rate < 0)
+    {
+        fprintf(stderr, "Invalid rate '%s', expected bytes per second with an optional k/m/g suffix\n", text);
+        exit(1);
+    }
+    return rate;
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    int workers = 1;
+    long cache_mb = DEFAULT_CACHE_MB;
+    int opt;
+    bool write_behind = false;
+    int metrics_port = 0;
+    while ((opt = getopt(argc, argv, "w:c:m:l:s:i:t:n:p:x:q:d:W")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            // -w 0 表示每个CPU核心一个工作线程
+            workers = atoi(optarg);
+            if (workers <= 0)
+                workers = sysconf(_SC_NPROCESSORS_ONLN);
+            break;
+        case 'l':
+            // 日志级别: debug会记录每条命令
+            if (strcmp(optarg, "debug") == 0)
+                log_threshold = LOG_DEBUG;
+            else if (strcmp(optarg, "info") == 0)
+                log_threshold = LOG_INFO;
+            else if (strcmp(optarg, "warn") == 0)
+                log_threshold = LOG_WARN;
+            else if (strcmp(optarg, "error") == 0)
+                log_threshold = LOG_ERROR;
+            else
+            {
+                fprintf(stderr, "Unknown log level '%s', expected debug, info, warn or error\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            // 每个会话的传输速率上限
+            session_rate = parse_rate(optarg);
+            break;
+        case 'i':
+            // 同一客户端IP所有会话合计的传输速率上限
+            ip_rate = parse_rate(optarg);
+            break;
+        case 't':
+            // 整个服务器的传输速率上限
+            total_rate = parse_rate(optarg);
+            break;
+        case 'n':
+            // 同时连接的会话总数上限, 超过时应答421并关闭连接; 0表示不限制
+            max_sessions = std::max(atoi(optarg), 0);
+            break;
+        case 'p':
+            // 同一客户端IP的会话数上限
+            max_per_ip = atoi(optarg);
+            break;
+        case 'x':
+            // 同时进行的GET/PUT类传输数上限, 超过时排队
+            max_transfers = atoi(optarg);
+            break;
+        case 'q':
+            // 排队等待传输名额的命令数上限, 队列满时应答450
+            max_queue = atoi(optarg);
+            break;
+        case 'd':
+            // 超时秒数: 空闲[,命令[,传输]], 0表示不检查
+            sscanf(optarg, "%d,%d,%d", &idle_timeout, &command_timeout, &transfer_timeout);
+            break;
+        case 'm':
+            // 在127.0.0.1的指定端口上提供Prometheus格式的指标
+            metrics_port = atoi(optarg);
+            break;
+        case 'W':
+            // 上传的大文件边写边回写, 不占用页缓存
+            write_behind = true;
+            break;
+        case 'c':
+            // -c 0 关闭目录缓存
+            cache_mb = atol(optarg);
+            if (cache_mb < 0)
+                cache_mb = 0;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w workers] [-c cache_mb] [-m metrics_port] [-l level] [-s session_rate] [-i ip_rate] [-t total_rate] [-n max_sessions] [-p max_per_ip] [-x max_transfers] [-q queue_len] [-d idle[,command[,transfer]]] [-W] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1)
     {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-w workers] [-c cache_mb] [-m metrics_port] [-l level] [-s session_rate] [-i ip_rate] [-t total_rate] [-n max_sessions] [-p max_per_ip] [-x max_transfers] [-q queue_len] [-d idle[,command[,transfer]]] [-W] <port>\n", argv[0]);
         exit(1);
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
+
+    // 客户端断开时send不应终止整个进程
+    signal(SIGPIPE, SIG_IGN);
+    crc32c_init();
+    init_command_table();
+    clock_gettime(CLOCK_MONOTONIC, &server_start);
+    // 把描述符的软上限提高到硬上限, 没有指定会话总数上限时按每个会话最多占用的描述符数计算
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0)
+    {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+        getrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    if (max_sessions < 0)
+    {
+        rlim_t limit = nofile.rlim_cur == RLIM_INFINITY ? (rlim_t)INT_MAX : nofile.rlim_cur;
+        rlim_t overhead = RESERVED_FDS + 8 * (rlim_t)workers;
+        max_sessions = limit > overhead ? (int)std::min((limit - overhead) / FDS_PER_SESSION, (rlim_t)INT_MAX) : 1;
+    }
+    shaping = session_rate > 0 || ip_rate > 0 || total_rate > 0;
+    idle_timeout = std::max(idle_timeout, 0);
+    command_timeout = std::max(command_timeout, 0);
+    transfer_timeout = std::max(transfer_timeout, 0);
+    for (int timeout : {idle_timeout, command_timeout, transfer_timeout})
+        if (timeout > 0 && (deadline_recheck == 0 || (uint64_t)timeout < deadline_recheck))
+            deadline_recheck = timeout;
+    deadline_recheck *= 1000 / WHEEL_TICK_MS;
+    bucket_init(&total_bucket, total_rate);
+
+    // 日志由后台线程统一输出, 工作线程只写入自己的缓冲区
+    pthread_t log_thread;
+    if (pthread_create(&log_thread, NULL, log_main, NULL) != 0)
+        error("Error: cannot create log thread");
+    pthread_detach(log_thread);
 
-    int sockfd = start_server(port);
+    // 回写模式下等待回写和丢弃页缓存由单独的线程进行
+    if (write_behind)
+    {
+        pthread_t writeback_thread;
+        if (pthread_create(&writeback_thread, NULL, writeback_main, NULL) != 0)
+            error("Error: cannot create writeback thread");
+        pthread_detach(writeback_thread);
+    }
 
-    while (true)
+    // 只有一个工作线程时不绑定CPU, 保持与单线程服务器相同的调度行为
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct event_loop *loops = new event_loop[workers];
+    event_loops = loops;
+    worker_count = workers;
+    for (int i = 0; i < workers; i++)
     {
-        // 接受客户端的连接请求
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-        int new_sockfd = accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (new_sockfd < 0)
-            error("Error: cannot accept client connection");
+        loops[i].id = i;
+        loops[i].cpu = (workers > 1 && ncpus > 0) ? i % ncpus : -1;
+        loops[i].port = port;
+        loops[i].write_behind = write_behind;
+        loops[i].cache_budget = (size_t)cache_mb * 1024 * 1024 / workers;
+        init_event_loop(&loops[i]);
+    }
 
-        printf("Client connected. IP address: %s, port: %d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    printf("Server started. Listening on port %d with %d worker(s)...\n", port, workers);
 
-        // 处理与客户端的通信
-        handle_client(new_sockfd, client_addr);
+    if (metrics_port > 0)
+    {
+        pthread_t metrics_thread;
+        int metricsfd = start_metrics(metrics_port);
+        if (pthread_create(&metrics_thread, NULL, metrics_main, (void *)(intptr_t)metricsfd) != 0)
+            error("Error: cannot create metrics thread");
+        pthread_detach(metrics_thread);
+        printf("Metrics available at http://127.0.0.1:%d/metrics\n", metrics_port);
     }
 
-    close(sockfd);
+    // 第0个事件循环在主线程中运行
+    for (int i = 1; i < workers; i++)
+        if (pthread_create(&loops[i].thread, NULL, worker_main, &loops[i]) != 0)
+            error("Error: cannot create worker thread");
+    loops[0].thread = pthread_self();
+    worker_main(&loops[0]);
+
+    for (int i = 1; i < workers; i++)
+        pthread_join(loops[i].thread, NULL);
+    for (int i = 0; i < workers; i++)
+    {
+        close(loops[i].epfd);
+        close(loops[i].listenfd);
+        close(loops[i].timerfd);
+        if (loops[i].inotifyfd >= 0)
+            close(loops[i].inotifyfd);
+    }
+    delete[] loops;
 
     return 0;
-}
\ No newline at end of file
+}